@@ -6,18 +6,50 @@
 static const uint8_t power_ = 2;
 
 static float input_ [1<<power_] = { 0.f, 1.f, 2.f, 3.f };
-static float output_[1<<power_] = { 0 }; 
+static float output_[1<<power_] = { 0 };
+
+// the same again on 24 bit pcm, done exactly in integers
+static const int kPcmBits  = 24;
+static const int kPcmPower = 14;
+
+static int32_t pcm_   [1<<kPcmPower];
+static int64_t coeffs_[1<<kPcmPower];
+static double  render_[1<<kPcmPower];
 
 int main(int argc, char* argv[])
 {
   // do the sequency ordered walsh hadamard transform
-  fwht::SequencyOrdered<float, float>(input_, power_, output_);
+  // it's small enough to be unrolled at compile time, so there's no plan to build
+  fwht::SequencyOrdered<power_>(input_, output_);
 
   // distort by removing a component
   output_[3] = 0;
 
   // perform the inverse, to end up back where we started
-  fwht::SequencyOrderedInverse<float, float>(output_, power_, input_);
+  fwht::SequencyOrderedInverse<power_>(output_, input_);
+
+  // make sure the accumulators can't overflow for this much pcm
+  if (kPcmPower > fwht::MaxExactRoundTripPower<int64_t>(kPcmBits))
+    exit(EXIT_FAILURE);
+
+  // a full scale sawtooth
+  int N = 1 << kPcmPower;
+  for (int i = 0; i < N; ++i)
+    pcm_[i] = (i * 1021) % (1 << kPcmBits) - (1 << (kPcmBits - 1));
+
+  // the unscaled transform, with no rounding anywhere
+  fwht::Plan<int64_t> plan(kPcmPower);
+  plan.SetPower(kPcmPower);
+  plan.Inverse(pcm_, coeffs_);
+
+  // distort by removing a component
+  coeffs_[3] = 0;
+
+  // the transform again is the inverse times N, and N is a power of two,
+  // so dividing it out is exact too. this comes out the same on any machine
+  plan.Inverse(coeffs_, coeffs_);
+  for (int i = 0; i < N; ++i)
+    render_[i] = static_cast<double>(coeffs_[i]) / N;
 
   exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace algos
+{
+  // the alignment we use for everything the audio thread touches
+  // 64 bytes is a cache line, and is enough for the widest SIMD loads
+  static const size_t kAlignment = 64;
+
+  // allocate size bytes aligned to alignment (which must be a power of two)
+  // we stash the original pointer just before the aligned block so that
+  // AlignedFree can give it back, which works the same on every compiler
+  inline void* AlignedMalloc(size_t size, size_t alignment = kAlignment)
+  {
+    void* raw = malloc(size + alignment + sizeof(void*));
+    if (!raw)
+      return NULL;
+
+    uintptr_t start   = reinterpret_cast<uintptr_t>(raw) + sizeof(void*);
+    uintptr_t aligned = (start + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<void*>(aligned);
+  }
+
+  // free memory allocated with AlignedMalloc
+  inline void AlignedFree(void* ptr)
+  {
+    if (ptr)
+      free(reinterpret_cast<void**>(ptr)[-1]);
+  }
+
+  // a single aligned block that lots of arrays are carved out of, one after another,
+  // so that everything that's used together sits together, and there's one allocation
+  // instead of dozens. arrays taken from it are aligned like everything else, and they
+  // belong to the arena: they all go when it's freed (or reserved again).
+  // with no block at all it still counts up what it would have handed out, so a dry run
+  // through whatever takes from it says how big a block it needs.
+  // the block is cleared when it's reserved, and the arrays taken from it don't clear it
+  // again (so laying them out is cheap enough for the audio thread), so it's only meant
+  // to be laid out once per Reserve
+  class Arena
+  {
+  public:
+    Arena() : data_(NULL), size_(0), used_(0) {}
+    ~Arena() { AlignedFree(data_); }
+
+    // allocate a block of size bytes, all 0, in place of the old one
+    void Reserve(size_t size)
+    {
+      AlignedFree(data_);
+      data_ = static_cast<char*>(AlignedMalloc(size));
+      size_ = data_ ? size : 0;
+      used_ = 0;
+      if (data_)
+        memset(data_, 0, size_);
+    }
+
+    // give the block back
+    void Free()
+    {
+      AlignedFree(data_);
+      data_ = NULL;
+      size_ = 0;
+      used_ = 0;
+    }
+
+    // start handing out from the beginning of the block again
+    void Rewind() { used_ = 0; }
+
+    // take count Ts, or NULL if they don't fit (or it's a dry run)
+    template <typename T>
+    T* Take(size_t count)
+    {
+      size_t start = (used_ + kAlignment - 1) & ~(kAlignment - 1);
+      used_ = start + count * sizeof(T);
+      if (!data_ || used_ > size_)
+        return NULL;
+      return reinterpret_cast<T*>(data_ + start);
+    }
+
+    size_t Size() const { return size_; }
+    size_t Used() const { return used_; }
+
+    // trade blocks with another arena, without copying anything
+    void Swap(Arena& other)
+    {
+      char*  data = data_; data_ = other.data_; other.data_ = data;
+      size_t size = size_; size_ = other.size_; other.size_ = size;
+      size_t used = used_; used_ = other.used_; other.used_ = used;
+    }
+
+  private:
+    // not copyable, we own the block
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    char*  data_;
+    size_t size_;
+    size_t used_;
+  };
+
+  // a simple aligned array of plain old data
+  // it only allocates when Resize is called, so it's safe to use from
+  // the audio thread as long as the resizing happens somewhere else
+  template <typename T>
+  class AlignedArray
+  {
+  public:
+    AlignedArray() : data_(NULL), size_(0), owned_(false) {}
+    explicit AlignedArray(size_t size) : data_(NULL), size_(0), owned_(false) { Resize(size); }
+    ~AlignedArray() { Release(); }
+
+    // reallocate to hold size elements, all set to 0
+    // with an arena they're taken from that instead, which doesn't allocate anything
+    // (or clear anything, since the arena was cleared when it was reserved)
+    void Resize(size_t size, Arena* arena = NULL)
+    {
+      Release();
+      if (arena)
+        data_ = arena->Take<T>(size);
+      else
+        data_ = static_cast<T*>(AlignedMalloc(size * sizeof(T)));
+      owned_ = data_ && !arena;
+      size_  = data_ ? size : 0;
+      if (owned_)
+        memset(data_, 0, size_ * sizeof(T));
+    }
+
+    size_t size() const { return size_; }
+
+    T*       data()       { return data_; }
+    T const* data() const { return data_; }
+
+    T&       operator[](size_t i)       { return data_[i]; }
+    T const& operator[](size_t i) const { return data_[i]; }
+
+  private:
+    // not copyable, we own the memory
+    AlignedArray(const AlignedArray&);
+    AlignedArray& operator=(const AlignedArray&);
+
+    // free what we allocated ourselves (anything from an arena belongs to the arena)
+    void Release()
+    {
+      if (owned_)
+        AlignedFree(data_);
+      data_  = NULL;
+      size_  = 0;
+      owned_ = false;
+    }
+
+    T*     data_;
+    size_t size_;
+    bool   owned_;
+  };
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+// which x86 instruction sets we can use, checked once at run time
+// everything that isn't x86 just reports no extensions, and gets the scalar code
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+  #define ALGOS_X86 1
+  #if defined(_MSC_VER)
+    #include <intrin.h>
+  #else
+    #include <cpuid.h>
+  #endif
+#else
+  #define ALGOS_X86 0
+#endif
+
+// msvc lets us use any intrinsic anywhere, but gcc and clang need the function
+// to be marked with the instruction set it's allowed to use
+#if defined(__GNUC__)
+  #define ALGOS_TARGET(isa) __attribute__((target(isa)))
+#else
+  #define ALGOS_TARGET(isa)
+#endif
+
+// whether the compiler knows about the wider instruction sets at all
+// (avx2 arrived in visual studio 2012, avx-512 in visual studio 2017)
+#if ALGOS_X86 && (!defined(_MSC_VER) || _MSC_VER >= 1700)
+  #define ALGOS_HAVE_AVX2 1
+#else
+  #define ALGOS_HAVE_AVX2 0
+#endif
+
+#if ALGOS_X86 && (!defined(_MSC_VER) || _MSC_VER >= 1911)
+  #define ALGOS_HAVE_AVX512 1
+#else
+  #define ALGOS_HAVE_AVX512 0
+#endif
+
+namespace algos
+{
+  struct CpuFeatures
+  {
+    bool sse2;
+    bool avx2;
+    bool avx512f;
+  };
+
+#if ALGOS_X86
+  inline void CpuId(int leaf, int subleaf, unsigned int regs[4])
+  {
+  #if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, leaf, subleaf);
+    for (int i = 0; i < 4; ++i)
+      regs[i] = static_cast<unsigned int>(r[i]);
+  #else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+  #endif
+  }
+
+  // which register state the os saves for us on a context switch
+  inline unsigned long long XGetBV()
+  {
+  #if defined(_MSC_VER)
+    return _xgetbv(0);
+  #else
+    unsigned int lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (static_cast<unsigned long long>(hi) << 32) | lo;
+  #endif
+  }
+#endif
+
+  // find out what the cpu (and the os) supports
+  inline CpuFeatures DetectCpu()
+  {
+    CpuFeatures features = { false, false, false };
+
+#if ALGOS_X86
+    unsigned int regs[4];
+    CpuId(0, 0, regs);
+    unsigned int max_leaf = regs[0];
+
+    CpuId(1, 0, regs);
+    features.sse2 = (regs[3] & (1u << 26)) != 0;
+
+    // the wide registers are only usable if the os saves them, which it tells us through xcr0
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    unsigned long long xcr0 = osxsave ? XGetBV() : 0;
+    bool os_ymm = (xcr0 & 0x06) == 0x06;
+    bool os_zmm = (xcr0 & 0xe6) == 0xe6;
+
+    if (max_leaf >= 7)
+    {
+      CpuId(7, 0, regs);
+      features.avx2    = os_ymm && (regs[1] & (1u << 5))  != 0;
+      features.avx512f = os_zmm && (regs[1] & (1u << 16)) != 0;
+    }
+#endif
+
+    return features;
+  }
+
+  // the features of the machine we're running on, detected once when we're loaded
+  inline CpuFeatures const& Cpu()
+  {
+    static const CpuFeatures features = DetectCpu();
+    return features;
+  }
+}
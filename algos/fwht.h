@@ -1,6 +1,13 @@
+#pragma once
+
 #include <cstdint>
+#include <cstring>
+#include <limits>
 #include <vector>
 
+#include "aligned.h"
+#include "fwht_simd.h"
+
 namespace fwht
 {
   // adapted from: http://graphics.stanford.edu/~seander/bithacks.html
@@ -8,7 +15,7 @@ namespace fwht
   {
     unsigned int r = v & 1;
     while (bits--)
-    {   
+    {
       v >>= 1;
       r <<= 1;
       r |= v & 1;
@@ -16,81 +23,868 @@ namespace fwht
     return r;
   }
 
-  template <typename TIn, typename TOut>
-  void SequencyOrderedInverse(TIn const* input, int power_of_two, TOut* output)
-  {
-    // get the starting values
-    int N  = 1 << power_of_two;
-    int k1 = N;
-    int k2 = 1;
-    int k3 = N >> 1;
+  // big transforms are done a tile at a time so that the later passes stay in L1.
+  // this is the size of those tiles, in bytes
+  static const int kTileBytes = 16384;
 
-    // create an array of indices
-    std::vector<uint32_t> indices(N, 0);
-    for (int i = 0; i < N; ++i)
-      indices[i] = i;
+  // when we fuse passes together we work on this many elements of each strided
+  // segment at a time, so 8 segments of doubles are 8K
+  static const int kFusedChunk = 128;
 
-    // we only need to reverse the bits if we have more than one index!
-    if (power_of_two > 0)
-    {
-      // reverse the bits in each index
-      for (std::vector<uint32_t>::iterator it = indices.begin();
-        it != indices.end(); ++it)
-        *it = ReverseBits(*it, power_of_two - 1);
-    }
+  // when a transform is split across threads, how many pieces each thread gets
+  // (so one that's slow to get going doesn't hold up all the rest)
+  static const int kPiecesPerWay = 4;
 
-    // use those indices to create a rearranged input array
-    // as the first pass at the output array
-    for (int i = 0; i < N; ++i)
-      output[i] = static_cast<TOut>(input[indices[i]]);
+  // what a thread pool runs, task(context, i) for every i in [0, count)
+  typedef void (*Task)(void* context, int index);
 
-    // in-place iteration begins here 
-    for (int i1 = 0; i1 < power_of_two; ++i1)
+  // the orderings of the transform, as in fwht1d.m
+  // they all have the same coefficients, just in a different order
+  enum Order
+  {
+    kSequency, // walsh order (fhtseq), sorted by the number of zero crossings
+    kDyadic,   // paley order (fhtdya)
+    kNatural   // hadamard order (fhtnat), which needs no reordering at all
+  };
+
+  // the in-place butterfly passes of the transform on one block
+  // for sequency order the data must already be in bit reversed order.
+  // within a sequency pass, even blocks put the sum on top and odd blocks put the
+  // difference on top, so rather than testing that on every butterfly we run each
+  // block as a straight add/sub (or sub/add) kernel. the dyadic and natural
+  // passes always put the sum on top.
+  // flip says whether this block is itself an odd block of a bigger sequency
+  // transform, which only affects its first pass
+  template <typename T>
+  void BlockStages(T* output, int power_of_two, bool sequency, bool flip)
+  {
+    Butterflies<T> const& kernels = Dispatch<T>::butterflies;
+
+    typename Butterflies<T>::Kernel odd_kernel = sequency ? kernels.sub_add : kernels.add_sub;
+    flip = flip && sequency;
+
+    int N = 1 << power_of_two;
+    for (int stage = 0; stage < power_of_two; ++stage)
     {
-      int L1 = 1;
+      int half  = N >> (stage + 1);
+      int block = half << 1;
 
-      for (int i2 = 0; i2 < k2; ++i2)
+      // the first pass is a single block
+      if (stage == 0)
       {
-        for (int i3 = 0; i3 < k3; ++i3)
-        {
-          int i = i3 + L1 - 1; 
-          int j = i + k3;
-
-          // get the values from the input vector
-          TOut temp1 = output[i];
-          TOut temp2 = output[j]; 
+        if (half < kernels.width)
+          flip ? SubAddScalar(output, output + half, half) : AddSubScalar(output, output + half, half);
+        else
+          flip ? kernels.sub_add(output, output + half, half) : kernels.add_sub(output, output + half, half);
+        continue;
+      }
 
-          if (i2 % 2)
+      // the blocks are too small for the vector kernels, so handle
+      // each pair of blocks with the inline scalar ones
+      if (half < kernels.width)
+      {
+        if (sequency)
+        {
+          for (int i = 0; i < N; i += block << 1)
           {
-            output[i] = temp1 - temp2;
-            output[j] = temp1 + temp2;
+            AddSubScalar(output + i,         output + i + half,         half);
+            SubAddScalar(output + i + block, output + i + block + half, half);
           }
-          else
+        }
+        else
+        {
+          for (int i = 0; i < N; i += block)
+            AddSubScalar(output + i, output + i + half, half);
+        }
+        continue;
+      }
+
+      for (int i = 0; i < N; i += block << 1)
+      {
+        kernels.add_sub(output + i,         output + i + half,         half);
+        odd_kernel     (output + i + block, output + i + block + half, half);
+      }
+    }
+  }
+
+  // the first `stages` passes of a block of size 2^power_of_two, fused into one sweep.
+  // the block is split into 2^stages strided segments, and we run all of the passes
+  // on a chunk of every segment while it's still in cache, rather than streaming
+  // the whole block through once per pass (i.e. a radix 4 or 8 step).
+  // the columns of the segments never mix, so this only has to do [begin, end) of them
+  // (a multiple of kFusedChunk apart, unless it's all of them)
+  template <typename T>
+  void FusedStages(T* block, int power_of_two, int stages, bool sequency, bool flip, int begin, int end)
+  {
+    Butterflies<T> const& kernels = Dispatch<T>::butterflies;
+
+    int stride = 1 << (power_of_two - stages);
+    int chunk  = stride < kFusedChunk ? stride : kFusedChunk;
+
+    for (int c = begin; c < end; c += chunk)
+    {
+      for (int stage = 0; stage < stages; ++stage)
+      {
+        // segments are grouped into the blocks of this pass, and each group
+        // pairs its top half of segments with its bottom half
+        int span = 1 << (stages - stage);
+        int half = span >> 1;
+
+        for (int g = 0; g < (1 << stage); ++g)
+        {
+          bool odd = sequency && (stage == 0 ? flip : (g & 1) != 0);
+          for (int m = 0; m < half; ++m)
           {
-            output[i] = temp1 + temp2;
-            output[j] = temp1 - temp2;
+            T* lo = block + (g * span + m) * stride + c;
+            T* hi = lo + half * stride;
+            odd ? kernels.sub_add(lo, hi, chunk) : kernels.add_sub(lo, hi, chunk);
           }
         }
+      }
+    }
+  }
+
+  template <typename T>
+  void FusedStages(T* block, int power_of_two, int stages, bool sequency, bool flip)
+  { FusedStages(block, power_of_two, stages, sequency, flip, 0, 1 << (power_of_two - stages)); }
+
+  // the biggest block of Ts that fits in a tile
+  template <typename T>
+  int TilePower()
+  {
+    int tile_power = 0;
+    while ((static_cast<int>(sizeof(T)) << (tile_power + 1)) <= kTileBytes)
+      ++tile_power;
+    return tile_power;
+  }
+
+  // transforms this small are stamped out at compile time, see Unrolled
+  static const int kMaxUnrolledPower = 6;
+
+  // the butterflies of one run of a block, lo[i] against lo[i + Half] for every i,
+  // one after the other with no loop. odd runs of a sequency pass put the difference on top
+  template <typename T, int Half, bool Odd, int Index = 0, bool Done = (Index == Half)>
+  struct UnrolledRun
+  {
+    static void Run(T* lo)
+    {
+      T temp1 = lo[Index];
+      T temp2 = lo[Index + Half];
+      lo[Index]        = Odd ? temp1 - temp2 : temp1 + temp2;
+      lo[Index + Half] = Odd ? temp1 + temp2 : temp1 - temp2;
+      UnrolledRun<T, Half, Odd, Index + 1>::Run(lo);
+    }
+  };
+
+  template <typename T, int Half, bool Odd, int Index>
+  struct UnrolledRun<T, Half, Odd, Index, true>
+  {
+    static void Run(T*) {}
+  };
+
+  // every block of one pass of a 2^Power point transform, with the parities worked
+  // out as in BlockStages
+  template <typename T, int Power, int Stage, bool Sequency, bool Flip, int Block = 0, bool Done = (Block == (1 << Stage))>
+  struct UnrolledPass
+  {
+    static const int  kHalf = 1 << (Power - Stage - 1);
+    static const bool kOdd  = Sequency && (Stage == 0 ? Flip : (Block & 1) != 0);
+
+    static void Run(T* output)
+    {
+      UnrolledRun<T, kHalf, kOdd>::Run(output + 2 * kHalf * Block);
+      UnrolledPass<T, Power, Stage, Sequency, Flip, Block + 1>::Run(output);
+    }
+  };
+
+  template <typename T, int Power, int Stage, bool Sequency, bool Flip, int Block>
+  struct UnrolledPass<T, Power, Stage, Sequency, Flip, Block, true>
+  {
+    static void Run(T*) {}
+  };
+
+  // and all of the passes
+  template <typename T, int Power, bool Sequency, bool Flip, int Stage = 0, bool Done = (Stage == Power)>
+  struct UnrolledStages
+  {
+    static void Run(T* output)
+    {
+      UnrolledPass<T, Power, Stage, Sequency, Flip>::Run(output);
+      UnrolledStages<T, Power, Sequency, Flip, Stage + 1>::Run(output);
+    }
+  };
+
+  template <typename T, int Power, bool Sequency, bool Flip, int Stage>
+  struct UnrolledStages<T, Power, Sequency, Flip, Stage, true>
+  {
+    static void Run(T*) {}
+  };
+
+  // the passes of the small transforms, every butterfly written out. at 64 points or
+  // less, the loops, the kernel calls and picking between them cost more than the adds
+  // do, so these have none of them: a window of 2^power runs kernels[power][kind],
+  // where kind is 0 for the natural and dyadic passes, 1 for sequency and 2 for a
+  // flipped sequency block (see BlockStages)
+  template <typename T>
+  struct Unrolled
+  {
+    typedef void (*Kernel)(T* output);
+    static const Kernel kernels[kMaxUnrolledPower + 1][3];
+  };
+
+  #define FWHT_UNROLLED_KERNELS(power)                                                        \
+    { &UnrolledStages<T, power, false, false>::Run, &UnrolledStages<T, power, true, false>::Run, \
+      &UnrolledStages<T, power, true, true>::Run }
+
+  template <typename T>
+  const typename Unrolled<T>::Kernel Unrolled<T>::kernels[kMaxUnrolledPower + 1][3] =
+  {
+    FWHT_UNROLLED_KERNELS(0), FWHT_UNROLLED_KERNELS(1), FWHT_UNROLLED_KERNELS(2), FWHT_UNROLLED_KERNELS(3),
+    FWHT_UNROLLED_KERNELS(4), FWHT_UNROLLED_KERNELS(5), FWHT_UNROLLED_KERNELS(6)
+  };
+
+  #undef FWHT_UNROLLED_KERNELS
+
+  // all of the butterfly passes of the transform
+  // the smallest transforms are unrolled (see Unrolled), and other small ones just run
+  // pass after pass. big ones run the passes whose blocks
+  // are bigger than a tile two or three at a time, and then finish each tile
+  // on its own while it sits in L1, so a 2^14 point transform touches memory
+  // three times instead of fourteen.
+  // flip says whether this is an odd block of a bigger sequency transform, as for BlockStages
+  template <typename T>
+  void Stages(T* output, int power_of_two, bool sequency, bool flip = false)
+  {
+    if (power_of_two <= kMaxUnrolledPower)
+    {
+      Unrolled<T>::kernels[power_of_two][sequency ? 1 + flip : 0](output);
+      return;
+    }
+
+    int tile_power = TilePower<T>();
+    if (power_of_two <= tile_power)
+    {
+      BlockStages(output, power_of_two, sequency, flip);
+      return;
+    }
+
+    // the passes where the blocks don't fit in a tile, up to three at once
+    int top = power_of_two - tile_power;
+    for (int stage = 0; stage < top; )
+    {
+      int fused       = top - stage < 3 ? top - stage : 3;
+      int block_power = power_of_two - stage;
+
+      // a block's parity is just its index at this pass (apart from the first, which is ours)
+      for (int b = 0; b < (1 << stage); ++b)
+        FusedStages(output + (b << block_power), block_power, fused, sequency, stage == 0 ? flip : (b & 1) != 0);
+
+      stage += fused;
+    }
+
+    // and the rest of the passes, one tile at a time
+    for (int t = 0; t < (1 << top); ++t)
+      BlockStages(output + (t << tile_power), tile_power, sequency, (t & 1) != 0);
+  }
+
+  // what the threads share when a transform's passes are split up, see ParallelStages
+  template <typename T>
+  struct SplitJob
+  {
+    T*   output;
+    bool sequency;
+
+    // the passes the columns are shared out for: at pass `stage`, every block of
+    // 2^block_power does `fused` passes, and each task does `columns` of every block
+    int stage;
+    int fused;
+    int block_power;
+    int columns;
+
+    // the independent blocks the rest of the passes are done on
+    int split_power;
+  };
+
+  template <typename T>
+  void RunSplitColumns(void* context, int index)
+  {
+    SplitJob<T> const& job   = *static_cast<SplitJob<T> const*>(context);
+    int                begin = index * job.columns;
+    for (int b = 0; b < (1 << job.stage); ++b)
+    {
+      bool odd = job.stage > 0 && (b & 1) != 0;
+      FusedStages(job.output + (static_cast<size_t>(b) << job.block_power), job.block_power, job.fused, job.sequency, odd,
+                  begin, begin + job.columns);
+    }
+  }
+
+  template <typename T>
+  void RunSplitBlock(void* context, int index)
+  {
+    SplitJob<T> const& job = *static_cast<SplitJob<T> const*>(context);
+    Stages(job.output + (static_cast<size_t>(index) << job.split_power), job.split_power, job.sequency, (index & 1) != 0);
+  }
+
+  // the same passes as Stages, shared out over a pool of threads, for transforms too big
+  // for any one core's cache. the first few passes are the fused sweeps over strided
+  // segments, whose columns never mix, so every thread takes some of the columns. after
+  // those the transform has come apart into independent blocks, which the threads share
+  // out and finish in cache like any other transform. every butterfly adds up exactly the
+  // same numbers as it does in Stages, so the output is the same, bit for bit.
+  // the pool needs Ways(), how many threads it runs on (counting the caller's), and
+  // Run(task, context, count), which runs them all and returns once they're done
+  template <typename T, typename Pool>
+  void ParallelStages(T* output, int power_of_two, bool sequency, Pool& pool)
+  {
+    int ways       = pool.Ways();
+    int tile_power = TilePower<T>();
+    int top        = power_of_two - tile_power;
+    if (ways <= 1 || top <= 0)
+    {
+      Stages(output, power_of_two, sequency);
+      return;
+    }
+
+    // enough blocks for every thread to have a few, as long as they're no smaller than a tile
+    int split = 0;
+    while ((1 << split) < ways * kPiecesPerWay && split < top)
+      ++split;
+
+    SplitJob<T> job;
+    job.output      = output;
+    job.sequency    = sequency;
+    job.split_power = power_of_two - split;
+
+    // the passes before that, up to three at a time like Stages, with the columns shared out
+    // in whole chunks. there are at least as many columns as there are in a tile
+    for (int stage = 0; stage < split; )
+    {
+      job.stage       = stage;
+      job.fused       = split - stage < 3 ? split - stage : 3;
+      job.block_power = power_of_two - stage;
+
+      int stride = 1 << (job.block_power - job.fused);
+      int pieces = 1;
+      while (pieces < ways * kPiecesPerWay && stride / (pieces << 1) >= kFusedChunk)
+        pieces <<= 1;
+      job.columns = stride / pieces;
+
+      pool.Run(&RunSplitColumns<T>, &job, pieces);
+      stage += job.fused;
+    }
+
+    pool.Run(&RunSplitBlock<T>, &job, 1 << split);
+  }
+
+  // the passes of the sequency ordered transform, on bit reversed data
+  template <typename T>
+  void SequencyStages(T* output, int power_of_two)
+  { Stages(output, power_of_two, true); }
+
+  // the passes of the natural ordered transform, which are also the dyadic
+  // ordered transform if the data is bit reversed
+  template <typename T>
+  void HadamardStages(T* output, int power_of_two)
+  { Stages(output, power_of_two, false); }
+
+  // exact transforms
+  // the butterflies only add and subtract, so on integer samples (pcm, say) the unscaled
+  // transform can be done in integers with no rounding at all, and comes out the same
+  // on every machine. Acc is the integer type it's done in, and all it has to do is not
+  // overflow. every pass at most doubles the biggest magnitude, so 2^power points of
+  // input_bits signed samples need input_bits + power bits, plus one spare so that
+  // -2^(input_bits - 1) can't overflow on the way back up. int64_t does 24 bit pcm up
+  // to 2^39 points, int32_t does 16 bit pcm up to 2^15 (but 24 bit only up to 2^7)
+  template <typename Acc>
+  int MaxExactPower(int input_bits)
+  { return std::numeric_limits<Acc>::digits - input_bits; }
+
+  // the same for a transform, then zeroing out some of the coefficients (any of them),
+  // then the transform again. orthogonality keeps the energy of what's left no more than
+  // N times the input's, so an output is at most N^1.5 times the biggest sample and
+  // needs 1.5 * power more bits: 2^26 points of 24 bit pcm in int64_t, 2^10 of 16 bit
+  // pcm in int32_t. divide the result by N at the end (a power of two, so that's exact in
+  // doubles) and it's the round trip, as exactly as the output type can hold it
+  template <typename Acc>
+  int MaxExactRoundTripPower(int input_bits)
+  { return 2 * MaxExactPower<Acc>(input_bits) / 3; }
+
+  // a reusable plan for the transforms
+  // it owns the bit reversal and reordering tables and some scratch space,
+  // so that once it's built running the transform doesn't allocate or rebuild any tables.
+  // T is the type the butterflies are computed in. with an integer T there's no 1/N to
+  // scale by, so only the (unscaled) Inverse can be used, both ways (see MaxExactPower)
+  template <typename T>
+  class Plan
+  {
+  public:
+    // allocate enough room for transforms up to 2^max_power
+    // this is the only place we allocate
+    explicit Plan(int max_power)
+      : max_power_(max_power), power_(-1),
+        indices_(1<<max_power), natural_index_(1<<max_power), sequency_index_(1<<max_power),
+        scratch_(1<<max_power)
+    { SetPower(0); }
+
+    // rebuild the tables for a new window power (<= max power)
+    // this is O(N) and doesn't allocate, so it's cheap enough to call on a parameter change
+    void SetPower(int power_of_two)
+    {
+      if (power_of_two < 0)          power_of_two = 0;
+      if (power_of_two > max_power_) power_of_two = max_power_;
+      if (power_of_two == power_)
+        return;
+
+      // we only need to reverse the bits if we have more than one index!
+      int N = 1 << power_of_two;
+      for (int i = 0; i < N; ++i)
+        indices_[i] = power_of_two > 0 ? ReverseBits(i, power_of_two - 1) : i;
+
+      // sequency coefficient k is the natural coefficient at the bit reversed
+      // gray code of k
+      for (int k = 0; k < N; ++k)
+      {
+        uint32_t natural = indices_[k ^ (k >> 1)];
+        natural_index_ [k]       = natural;
+        sequency_index_[natural] = k;
+      }
+
+      power_ = power_of_two;
+    }
+
+    int Power()    const { return power_; }
+    int Size()     const { return 1 << power_; }
+    int MaxPower() const { return max_power_; }
+
+    // the bit reversed order of the input for the current power
+    uint32_t const* Indices() const { return indices_.data(); }
+
+    // the natural index of each sequency ordered coefficient
+    uint32_t const* NaturalIndex() const { return natural_index_.data(); }
+
+    // the sequency index of each natural ordered coefficient
+    // if you only need to know which coefficient is which (for filtering, say),
+    // you can work on the natural order directly and skip reordering altogether
+    uint32_t const* SequencyIndex() const { return sequency_index_.data(); }
+
+    // scratch space of Size() elements that callers can use between transforms
+    T* Scratch() { return scratch_.data(); }
+
+    // the forward transform, scaled by 1/N
+    // input and output may be the same array
+    template <typename TIn>
+    void Forward(TIn const* input, T* output, Order order = kSequency)
+    {
+      Inverse(input, output, order);
+      Scale(output);
+    }
+
+    // the inverse transform, which is the forward one without the 1/N
+    // input and output may be the same array
+    template <typename TIn, typename TOut>
+    void Inverse(TIn const* input, TOut* output, Order order = kSequency)
+    {
+      Serial serial;
+      Inverse(input, output, order, serial);
+    }
+
+    // the same transforms, with the passes shared out over a pool of threads (see ParallelStages),
+    // for transforms too big for one core. the output is exactly the same as without it
+    template <typename TIn, typename Pool>
+    void Forward(TIn const* input, T* output, Order order, Pool& pool)
+    {
+      Inverse(input, output, order, pool);
+      Scale(output);
+    }
+
+    template <typename TIn, typename TOut, typename Pool>
+    void Inverse(TIn const* input, TOut* output, Order order, Pool& pool)
+    {
+      T* work = Work(output);
+      bool in_place = static_cast<void const*>(input) == static_cast<void const*>(work);
+
+      // the bit reversal is its own inverse, so if we're working in place
+      // we can just swap pairs instead of needing another copy
+      if (order == kNatural)
+      {
+        if (!in_place)
+          Copy(input, work);
+      }
+      else if (in_place)
+        PermuteInPlace(work);
+      else
+        Permute(input, work);
+
+      RunStages(work, order == kSequency, pool);
+      Store(work, output);
+    }
+
+    // the same transforms for a window that's split in two, e.g. the end of a ring buffer:
+    // the window is first[0..first_size) followed by second[0..Size() - first_size).
+    // the first pass reads straight from both halves, so the window never has to be
+    // put back together. the output can't overlap the input here.
+    // if there's a taper (Size() elements), each input sample is multiplied by it
+    // on the way in, so windowing doesn't cost a pass of its own
+    template <typename TIn>
+    void Forward(TIn const* first, int first_size, TIn const* second, T* output, Order order = kSequency, T const* taper = NULL)
+    {
+      Inverse(first, first_size, second, output, order, taper);
+      Scale(output);
+    }
+
+    template <typename TIn, typename TOut>
+    void Inverse(TIn const* first, int first_size, TIn const* second, TOut* output, Order order = kSequency, T const* taper = NULL)
+    {
+      Serial serial;
+      Inverse(first, first_size, second, output, order, taper, serial);
+    }
+
+    // and shared out over a pool of threads
+    template <typename TIn, typename Pool>
+    void Forward(TIn const* first, int first_size, TIn const* second, T* output, Order order, T const* taper, Pool& pool)
+    {
+      Inverse(first, first_size, second, output, order, taper, pool);
+      Scale(output);
+    }
+
+    template <typename TIn, typename TOut, typename Pool>
+    void Inverse(TIn const* first, int first_size, TIn const* second, TOut* output, Order order, T const* taper, Pool& pool)
+    {
+      T* work = Work(output);
+
+      if (taper)
+        Gather(first, first_size, second, work, order, Taper(taper));
+      else
+        Gather(first, first_size, second, work, order, NoTaper());
+
+      RunStages(work, order == kSequency, pool);
+      Store(work, output);
+    }
+
+    // only the newest `count` samples (a power of two, <= Size()) of the natural ordered
+    // inverse, in place. they end up in coefficients[0..count), and the rest is junk.
+    // the newer half of the inverse is the inverse of the difference of the two halves
+    // of the coefficients, so we fold those down first, which makes it about
+    // N + count log count adds instead of N log N
+    void InverseNewest(T* coefficients, int count)
+    {
+      for (int half = Size() >> 1; half >= count; half >>= 1)
+        for (int k = 0; k < half; ++k)
+          coefficients[k] -= coefficients[k + half];
+
+      int power = 0;
+      while ((1 << power) < count)
+        ++power;
+      Stages(coefficients, power, false);
+    }
+
+    // reorder natural ordered coefficients into sequency order (not in place)
+    template <typename TIn, typename TOut>
+    void NaturalToSequency(TIn const* natural, TOut* sequency) const
+    {
+      int             N     = Size();
+      uint32_t const* index = natural_index_.data();
+      for (int k = 0; k < N; ++k)
+        sequency[k] = static_cast<TOut>(natural[index[k]]);
+    }
+
+    // reorder sequency ordered coefficients into natural order (not in place)
+    template <typename TIn, typename TOut>
+    void SequencyToNatural(TIn const* sequency, TOut* natural) const
+    {
+      int             N     = Size();
+      uint32_t const* index = natural_index_.data();
+      for (int k = 0; k < N; ++k)
+        natural[index[k]] = static_cast<TOut>(sequency[k]);
+    }
+
+  private:
+    // not copyable, we own the tables
+    Plan(const Plan&);
+    Plan& operator=(const Plan&);
+
+    // the "pool" for doing the passes on the calling thread
+    struct Serial {};
+
+    void RunStages(T* work, bool sequency, Serial) { Stages(work, power_, sequency); }
+    template <typename Pool>
+    void RunStages(T* work, bool sequency, Pool& pool) { ParallelStages(work, power_, sequency, pool); }
+
+    // the part of the forward transform we're supposed to "remove" for the inverse transform!
+    void Scale(T* output)
+    {
+      static_assert(!std::numeric_limits<T>::is_integer, "integer transforms can't be scaled by 1/N, use Inverse");
+
+      int N     = Size();
+      T   scale = static_cast<T>(1) / N;
+      for (int i = 0; i < N; ++i)
+        output[i] *= scale;
+    }
+
+    // when the output is already our working type we do the butterflies in place,
+    // otherwise we do them in the scratch space and convert at the end
+    T* Work(T* output) { return output; }
+    template <typename TOut>
+    T* Work(TOut*) { return scratch_.data(); }
+
+    void Store(T const*, T*) {}
+    template <typename TOut>
+    void Store(T const* work, TOut* output)
+    {
+      int N = Size();
+      for (int i = 0; i < N; ++i)
+        output[i] = static_cast<TOut>(work[i]);
+    }
+
+    template <typename TIn>
+    void Copy(TIn const* input, T* work)
+    {
+      int N = Size();
+      for (int i = 0; i < N; ++i)
+        work[i] = static_cast<T>(input[i]);
+    }
+
+    // use the indices to create a rearranged input array
+    // as the first pass at the output array
+    template <typename TIn>
+    void Permute(TIn const* input, T* work)
+    {
+      int             N       = Size();
+      uint32_t const* indices = indices_.data();
+      for (int i = 0; i < N; ++i)
+        work[i] = static_cast<T>(input[indices[i]]);
+    }
+
+    // the tapers for Gather, so the loops are stamped out with and without the multiply
+    struct NoTaper
+    {
+      T operator()(T v, int) const { return v; }
+    };
+
+    struct Taper
+    {
+      explicit Taper(T const* taper) : taper(taper) {}
+      T operator()(T v, int i) const { return v * taper[i]; }
+      T const* taper;
+    };
+
+    // read a window that's split in two into work, in the order the stages want it
+    template <typename TIn, typename F>
+    void Gather(TIn const* first, int first_size, TIn const* second, T* work, Order order, F taper)
+    {
+      int N = Size();
+
+      if (order == kNatural)
+      {
+        for (int i = 0; i < first_size; ++i)
+          work[i] = taper(static_cast<T>(first[i]), i);
+        for (int i = first_size; i < N; ++i)
+          work[i] = taper(static_cast<T>(second[i - first_size]), i);
+      }
+      else
+      {
+        uint32_t const* indices = indices_.data();
+        for (int i = 0; i < N; ++i)
+        {
+          int j = static_cast<int>(indices[i]);
+          work[i] = taper(static_cast<T>(j < first_size ? first[j] : second[j - first_size]), j);
+        }
+      }
+    }
 
-        L1 += k1;
+    void PermuteInPlace(T* work)
+    {
+      int             N       = Size();
+      uint32_t const* indices = indices_.data();
+      for (int i = 0; i < N; ++i)
+      {
+        uint32_t j = indices[i];
+        if (static_cast<uint32_t>(i) < j)
+        {
+          T temp  = work[i];
+          work[i] = work[j];
+          work[j] = temp;
+        }
       }
+    }
+
+    int max_power_;
+    int power_;
+
+    algos::AlignedArray<uint32_t> indices_;
+    algos::AlignedArray<uint32_t> natural_index_;
+    algos::AlignedArray<uint32_t> sequency_index_;
+    algos::AlignedArray<T>        scratch_;
+  };
 
-      k1 >>= 1;
-      k2 <<= 1;
-      k3 >>= 1;
+  // a plan for every power up to a maximum, all built up front (about 20 bytes per
+  // sample of the biggest size, all told), so switching between sizes doesn't have
+  // to build anything, and plans of different sizes can be in use at once.
+  // bigger ones can be added later with Build, which allocates. a plan never moves once
+  // it's built, so the ones that are already there can be used while another is added
+  // (as long as whoever uses a plan saw it being built, e.g. through a lock)
+  template <typename T>
+  class PlanSet
+  {
+  public:
+    static const int kMaxPlanPower = 30;
+
+    explicit PlanSet(int max_power)
+    {
+      for (int power = 0; power <= kMaxPlanPower; ++power)
+        plans_[power] = NULL;
+      for (int power = 0; power <= max_power; ++power)
+        Build(power);
+    }
+
+    ~PlanSet()
+    {
+      for (int power = 0; power <= kMaxPlanPower; ++power)
+        delete plans_[power];
     }
+
+    // build the plan for 2^power, if there isn't one already
+    void Build(int power)
+    {
+      if (plans_[power])
+        return;
+      plans_[power] = new Plan<T>(power);
+      plans_[power]->SetPower(power);
+    }
+
+    bool Has(int power) const { return plans_[power] != NULL; }
+
+    // the plan for 2^power
+    Plan<T>& Get(int power) { return *plans_[power]; }
+
+  private:
+    // not copyable, we own the plans
+    PlanSet(const PlanSet&);
+    PlanSet& operator=(const PlanSet&);
+
+    Plan<T>* plans_[kMaxPlanPower + 1];
+  };
+
+  // convenience versions that build a plan on every call
+  // these allocate, so don't use them on the audio thread -- hold on to a Plan instead
+  template <typename TIn, typename TOut>
+  void SequencyOrderedInverse(TIn const* input, int power_of_two, TOut* output)
+  {
+    Plan<TOut> plan(power_of_two);
+    plan.SetPower(power_of_two);
+    plan.Inverse(input, output);
   }
 
   template <typename TIn, typename TOut>
   void SequencyOrdered(TIn const* input, int power_of_two, TOut* output)
   {
-    // Do the inverse
-    SequencyOrderedInverse(input, power_of_two, output);
+    Plan<TOut> plan(power_of_two);
+    plan.SetPower(power_of_two);
+    plan.Forward(input, output);
+  }
+
+  // and with the passes shared out over a pool of threads, see ParallelStages
+  template <typename TIn, typename TOut, typename Pool>
+  void SequencyOrderedInverse(TIn const* input, int power_of_two, TOut* output, Pool& pool)
+  {
+    Plan<TOut> plan(power_of_two);
+    plan.SetPower(power_of_two);
+    plan.Inverse(input, output, kSequency, pool);
+  }
+
+  template <typename TIn, typename TOut, typename Pool>
+  void SequencyOrdered(TIn const* input, int power_of_two, TOut* output, Pool& pool)
+  {
+    Plan<TOut> plan(power_of_two);
+    plan.SetPower(power_of_two);
+    plan.Forward(input, output, kSequency, pool);
+  }
 
-    // Then also do the part we're supposed to "remove" for the inverse transform!
-    // Remove this for inverse transform
-    int N  = 1 << power_of_two;
-    for (int i = 0; i < N; ++i)
-      output[i] /= N;
+  // Value with its low Bits bits reversed, at compile time
+  template <uint32_t Value, int Bits>
+  struct ReversedBits
+  {
+    static const uint32_t value = ((Value & 1) << (Bits - 1)) | ReversedBits<(Value >> 1), Bits - 1>::value;
+  };
+
+  template <uint32_t Value>
+  struct ReversedBits<Value, 0>
+  {
+    static const uint32_t value = 0;
+  };
+
+  // read 2^Power points into output in bit reversed order, unrolled like the stages
+  template <int Power, int Index = 0, bool Done = (Index == (1 << Power))>
+  struct UnrolledPermute
+  {
+    template <typename TIn, typename TOut>
+    static void Run(TIn const* input, TOut* output)
+    {
+      output[Index] = static_cast<TOut>(input[ReversedBits<Index, Power>::value]);
+      UnrolledPermute<Power, Index + 1>::Run(input, output);
+    }
+  };
+
+  template <int Power, int Index>
+  struct UnrolledPermute<Power, Index, true>
+  {
+    template <typename TIn, typename TOut>
+    static void Run(TIn const*, TOut*) {}
+  };
+
+  // and versions for the small transforms with the size fixed at compile time,
+  // e.g. SequencyOrdered<4>(input, output) for 16 points. there's no plan and no tables,
+  // the reordering and the passes are all unrolled, so they don't allocate and can be
+  // used anywhere. the output can't overlap the input
+  template <int Power, typename TIn, typename TOut>
+  void SequencyOrderedInverse(TIn const* input, TOut* output)
+  {
+    static_assert(Power >= 0 && Power <= kMaxUnrolledPower, "only the small transforms are unrolled");
+
+    UnrolledPermute<Power>::Run(input, output);
+    UnrolledStages<TOut, Power, true, false>::Run(output);
+  }
+
+  template <int Power, typename TIn, typename TOut>
+  void SequencyOrdered(TIn const* input, TOut* output)
+  {
+    static_assert(!std::numeric_limits<TOut>::is_integer, "integer transforms can't be scaled by 1/N, use the inverse");
+
+    SequencyOrderedInverse<Power>(input, output);
+    TOut scale = static_cast<TOut>(1) / (1 << Power);
+    for (int i = 0; i < (1 << Power); ++i)
+      output[i] *= scale;
+  }
+
+  template <typename TIn, typename TOut>
+  void DyadicOrderedInverse(TIn const* input, int power_of_two, TOut* output)
+  {
+    Plan<TOut> plan(power_of_two);
+    plan.SetPower(power_of_two);
+    plan.Inverse(input, output, kDyadic);
+  }
+
+  template <typename TIn, typename TOut>
+  void DyadicOrdered(TIn const* input, int power_of_two, TOut* output)
+  {
+    Plan<TOut> plan(power_of_two);
+    plan.SetPower(power_of_two);
+    plan.Forward(input, output, kDyadic);
+  }
+
+  template <typename TIn, typename TOut>
+  void NaturalOrderedInverse(TIn const* input, int power_of_two, TOut* output)
+  {
+    Plan<TOut> plan(power_of_two);
+    plan.SetPower(power_of_two);
+    plan.Inverse(input, output, kNatural);
+  }
+
+  template <typename TIn, typename TOut>
+  void NaturalOrdered(TIn const* input, int power_of_two, TOut* output)
+  {
+    Plan<TOut> plan(power_of_two);
+    plan.SetPower(power_of_two);
+    plan.Forward(input, output, kNatural);
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cpu_features.h"
+
+#if ALGOS_X86
+  #include <emmintrin.h>
+  #if ALGOS_HAVE_AVX2 || ALGOS_HAVE_AVX512
+    #include <immintrin.h>
+  #endif
+#endif
+
+// butterfly kernels for the walsh transforms
+// every pass of the transform is a run of blocks, and each block is a straight
+// run of (lo + hi, lo - hi) or (lo - hi, lo + hi), so these are the only two
+// operations we need to make fast. the best set is chosen once, when we're loaded.
+// the integer ones are for exact transforms of pcm (see MaxExactPower in fwht.h),
+// and since the butterflies never multiply, they vectorize just as well.
+
+namespace fwht
+{
+  template <typename T>
+  struct Butterflies
+  {
+    typedef void (*Kernel)(T* lo, T* hi, int n);
+
+    // lo = lo + hi, hi = lo - hi
+    Kernel add_sub;
+
+    // lo = lo - hi, hi = lo + hi
+    Kernel sub_add;
+
+    // the number of elements handled at once, blocks smaller than this use the scalar code
+    int width;
+
+    // for display/debugging
+    char const* name;
+  };
+
+  template <typename T>
+  inline void AddSubScalar(T* lo, T* hi, int n)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      T temp1 = lo[i];
+      T temp2 = hi[i];
+      lo[i] = temp1 + temp2;
+      hi[i] = temp1 - temp2;
+    }
+  }
+
+  template <typename T>
+  inline void SubAddScalar(T* lo, T* hi, int n)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      T temp1 = lo[i];
+      T temp2 = hi[i];
+      lo[i] = temp1 - temp2;
+      hi[i] = temp1 + temp2;
+    }
+  }
+
+  template <typename T>
+  Butterflies<T> ScalarButterflies()
+  {
+    Butterflies<T> b = { &AddSubScalar<T>, &SubAddScalar<T>, 1, "scalar" };
+    return b;
+  }
+
+#if ALGOS_X86
+
+  // the kernels for each instruction set only differ in their types and intrinsics,
+  // so we stamp them out. n is always a power of two in the transform,
+  // but we still finish off any remainder so they're safe to call with anything.
+  #define FWHT_BUTTERFLY_KERNELS(suffix, isa, T, V, W, load, store, add, sub)  \
+    ALGOS_TARGET(isa) inline void AddSub##suffix(T* lo, T* hi, int n)           \
+    {                                                                           \
+      int i = 0;                                                                \
+      for (; i + W <= n; i += W)                                                \
+      {                                                                         \
+        V a = load(lo + i);                                                     \
+        V b = load(hi + i);                                                     \
+        store(lo + i, add(a, b));                                               \
+        store(hi + i, sub(a, b));                                               \
+      }                                                                         \
+      AddSubScalar(lo + i, hi + i, n - i);                                      \
+    }                                                                           \
+    ALGOS_TARGET(isa) inline void SubAdd##suffix(T* lo, T* hi, int n)           \
+    {                                                                           \
+      int i = 0;                                                                \
+      for (; i + W <= n; i += W)                                                \
+      {                                                                         \
+        V a = load(lo + i);                                                     \
+        V b = load(hi + i);                                                     \
+        store(lo + i, sub(a, b));                                               \
+        store(hi + i, add(a, b));                                               \
+      }                                                                         \
+      SubAddScalar(lo + i, hi + i, n - i);                                      \
+    }
+
+  FWHT_BUTTERFLY_KERNELS(Sse2F,   "sse2",    float,  __m128,  4, _mm_loadu_ps,    _mm_storeu_ps,    _mm_add_ps,    _mm_sub_ps)
+  FWHT_BUTTERFLY_KERNELS(Sse2D,   "sse2",    double, __m128d, 2, _mm_loadu_pd,    _mm_storeu_pd,    _mm_add_pd,    _mm_sub_pd)
+#if ALGOS_HAVE_AVX2
+  FWHT_BUTTERFLY_KERNELS(Avx2F,   "avx2",    float,  __m256,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps, _mm256_sub_ps)
+  FWHT_BUTTERFLY_KERNELS(Avx2D,   "avx2",    double, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, _mm256_sub_pd)
+#endif
+#if ALGOS_HAVE_AVX512
+  FWHT_BUTTERFLY_KERNELS(Avx512F, "avx512f", float,  __m512,  16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_add_ps, _mm512_sub_ps)
+  FWHT_BUTTERFLY_KERNELS(Avx512D, "avx512f", double, __m512d, 8,  _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, _mm512_sub_pd)
+#endif
+
+  // the integer loads and stores take vector pointers, so these give them the same
+  // shape as the float ones
+  ALGOS_TARGET("sse2") inline __m128i LoadSse2I(void const* p) { return _mm_loadu_si128(static_cast<__m128i const*>(p)); }
+  ALGOS_TARGET("sse2") inline void    StoreSse2I(void* p, __m128i v) { _mm_storeu_si128(static_cast<__m128i*>(p), v); }
+
+  FWHT_BUTTERFLY_KERNELS(Sse2I32, "sse2",    int32_t, __m128i, 4, LoadSse2I,    StoreSse2I,    _mm_add_epi32, _mm_sub_epi32)
+  FWHT_BUTTERFLY_KERNELS(Sse2I64, "sse2",    int64_t, __m128i, 2, LoadSse2I,    StoreSse2I,    _mm_add_epi64, _mm_sub_epi64)
+#if ALGOS_HAVE_AVX2
+  ALGOS_TARGET("avx2") inline __m256i LoadAvx2I(void const* p) { return _mm256_loadu_si256(static_cast<__m256i const*>(p)); }
+  ALGOS_TARGET("avx2") inline void    StoreAvx2I(void* p, __m256i v) { _mm256_storeu_si256(static_cast<__m256i*>(p), v); }
+
+  FWHT_BUTTERFLY_KERNELS(Avx2I32, "avx2",    int32_t, __m256i, 8, LoadAvx2I,    StoreAvx2I,    _mm256_add_epi32, _mm256_sub_epi32)
+  FWHT_BUTTERFLY_KERNELS(Avx2I64, "avx2",    int64_t, __m256i, 4, LoadAvx2I,    StoreAvx2I,    _mm256_add_epi64, _mm256_sub_epi64)
+#endif
+#if ALGOS_HAVE_AVX512
+  ALGOS_TARGET("avx512f") inline __m512i LoadAvx512I(void const* p) { return _mm512_loadu_si512(p); }
+  ALGOS_TARGET("avx512f") inline void    StoreAvx512I(void* p, __m512i v) { _mm512_storeu_si512(p, v); }
+
+  FWHT_BUTTERFLY_KERNELS(Avx512I32, "avx512f", int32_t, __m512i, 16, LoadAvx512I, StoreAvx512I, _mm512_add_epi32, _mm512_sub_epi32)
+  FWHT_BUTTERFLY_KERNELS(Avx512I64, "avx512f", int64_t, __m512i, 8,  LoadAvx512I, StoreAvx512I, _mm512_add_epi64, _mm512_sub_epi64)
+#endif
+
+  #undef FWHT_BUTTERFLY_KERNELS
+
+#endif
+
+  // pick the widest kernels the cpu supports
+  // anything that isn't float, double, int32_t or int64_t just gets the scalar ones
+  template <typename T>
+  Butterflies<T> SelectButterflies()
+  { return ScalarButterflies<T>(); }
+
+  template <>
+  inline Butterflies<float> SelectButterflies<float>()
+  {
+#if ALGOS_X86
+    algos::CpuFeatures const& cpu = algos::Cpu();
+  #if ALGOS_HAVE_AVX512
+    if (cpu.avx512f) { Butterflies<float> b = { &AddSubAvx512F, &SubAddAvx512F, 16, "avx512f" }; return b; }
+  #endif
+  #if ALGOS_HAVE_AVX2
+    if (cpu.avx2)    { Butterflies<float> b = { &AddSubAvx2F,   &SubAddAvx2F,   8,  "avx2" };    return b; }
+  #endif
+    if (cpu.sse2)    { Butterflies<float> b = { &AddSubSse2F,   &SubAddSse2F,   4,  "sse2" };    return b; }
+#endif
+    return ScalarButterflies<float>();
+  }
+
+  template <>
+  inline Butterflies<double> SelectButterflies<double>()
+  {
+#if ALGOS_X86
+    algos::CpuFeatures const& cpu = algos::Cpu();
+  #if ALGOS_HAVE_AVX512
+    if (cpu.avx512f) { Butterflies<double> b = { &AddSubAvx512D, &SubAddAvx512D, 8, "avx512f" }; return b; }
+  #endif
+  #if ALGOS_HAVE_AVX2
+    if (cpu.avx2)    { Butterflies<double> b = { &AddSubAvx2D,   &SubAddAvx2D,   4, "avx2" };    return b; }
+  #endif
+    if (cpu.sse2)    { Butterflies<double> b = { &AddSubSse2D,   &SubAddSse2D,   2, "sse2" };    return b; }
+#endif
+    return ScalarButterflies<double>();
+  }
+
+  template <>
+  inline Butterflies<int32_t> SelectButterflies<int32_t>()
+  {
+#if ALGOS_X86
+    algos::CpuFeatures const& cpu = algos::Cpu();
+  #if ALGOS_HAVE_AVX512
+    if (cpu.avx512f) { Butterflies<int32_t> b = { &AddSubAvx512I32, &SubAddAvx512I32, 16, "avx512f" }; return b; }
+  #endif
+  #if ALGOS_HAVE_AVX2
+    if (cpu.avx2)    { Butterflies<int32_t> b = { &AddSubAvx2I32,   &SubAddAvx2I32,   8,  "avx2" };    return b; }
+  #endif
+    if (cpu.sse2)    { Butterflies<int32_t> b = { &AddSubSse2I32,   &SubAddSse2I32,   4,  "sse2" };    return b; }
+#endif
+    return ScalarButterflies<int32_t>();
+  }
+
+  template <>
+  inline Butterflies<int64_t> SelectButterflies<int64_t>()
+  {
+#if ALGOS_X86
+    algos::CpuFeatures const& cpu = algos::Cpu();
+  #if ALGOS_HAVE_AVX512
+    if (cpu.avx512f) { Butterflies<int64_t> b = { &AddSubAvx512I64, &SubAddAvx512I64, 8, "avx512f" }; return b; }
+  #endif
+  #if ALGOS_HAVE_AVX2
+    if (cpu.avx2)    { Butterflies<int64_t> b = { &AddSubAvx2I64,   &SubAddAvx2I64,   4, "avx2" };    return b; }
+  #endif
+    if (cpu.sse2)    { Butterflies<int64_t> b = { &AddSubSse2I64,   &SubAddSse2I64,   2, "sse2" };    return b; }
+#endif
+    return ScalarButterflies<int64_t>();
+  }
+
+  // the kernels in use for each type
+  // this is a static member so it gets filled in during static initialization,
+  // i.e. when the plug-in is loaded, and never on the audio thread
+  template <typename T>
+  struct Dispatch
+  {
+    static const Butterflies<T> butterflies;
+  };
+
+  template <typename T>
+  const Butterflies<T> Dispatch<T>::butterflies = SelectButterflies<T>();
+}
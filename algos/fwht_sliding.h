@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstring>
+
+#include "aligned.h"
+
+// a sliding walsh-hadamard transform, which keeps the natural ordered transform of
+// the last 2^power samples up to date one sample at a time.
+//
+// the natural ordered transform of a window is built from the transforms of its two halves,
+//   X[k] = A[k] + B[k], X[k + N/2] = A[k] - B[k]
+// where A is the transform of the older half and B of the newer half. the older half of
+// the window ending now is the newer half of the window that ended N/2 samples ago,
+// so if we remember the last N/2 + 1 transforms of every size below N, each new sample
+// only needs one combine per size: 2 + 4 + ... + N < 2N adds, instead of N log N for
+// a full transform. every coefficient is still exactly log N adds away from the samples,
+// the same as a full transform, so nothing drifts however long it runs.
+//
+// the catch is the memory: the remembered transforms take about N^2 / 3 elements,
+// so this is only for small windows. that's too many to clear (or fill in from past input)
+// whenever we start again, so we don't: it counts how many samples it's had since, and
+// treats any half window from before that as silence rather than looking it up. by the
+// time it's had a whole window everything it looks up is from since then anyway.
+
+namespace fwht
+{
+  template <typename T>
+  class SlidingTransform
+  {
+  public:
+    // allocate enough room for windows up to 2^max_power
+    // this is the only place we allocate
+    explicit SlidingTransform(int max_power) : max_power_(0), power_(0), pushed_(0) { Resize(max_power); }
+    SlidingTransform() : max_power_(0), power_(0), pushed_(0) {}
+
+    // the room comes from an arena if there is one
+    void Resize(int max_power, algos::Arena* arena = NULL)
+    {
+      max_power_ = max_power;
+
+      // level l holds the last 2^l + 1 transforms of size 2^l, for l < max_power
+      size_t total = 0;
+      for (int l = 0; l < max_power; ++l)
+        total += static_cast<size_t>(1 << l) * ((1 << l) + 1);
+      history_.Resize(total, arena);
+      top_.Resize(static_cast<size_t>(1) << max_power, arena);
+
+      SetPower(max_power);
+    }
+
+    // change the window size (<= max power), which starts again from silence
+    void SetPower(int power_of_two)
+    {
+      if (power_of_two < 0)          power_of_two = 0;
+      if (power_of_two > max_power_) power_of_two = max_power_;
+      power_ = power_of_two;
+
+      // lay the levels out one after another
+      size_t offset = 0;
+      for (int l = 0; l < power_; ++l)
+      {
+        offset_[l] = offset;
+        offset    += static_cast<size_t>(1 << l) * ((1 << l) + 1);
+      }
+      Reset();
+    }
+
+    // forget everything, as if the window was full of zeros
+    // this only clears the top transform, which is O(N), and leaves the history be (see above)
+    // (there might not be any, for a dry run through an arena)
+    void Reset()
+    {
+      if (top_.size() > 0)
+        memset(top_.data(), 0, Size() * sizeof(T));
+      for (int l = 0; l < power_; ++l)
+        slot_[l] = 0;
+      pushed_ = 0;
+    }
+
+    int Power()    const { return power_; }
+    int Size()     const { return 1 << power_; }
+    int MaxPower() const { return max_power_; }
+
+    // the unscaled natural ordered transform of the last Size() samples pushed
+    T const* Coefficients() const { return top_.data(); }
+
+    // add a sample to the end of the window (and drop the oldest one off the front)
+    template <typename TIn>
+    void Push(TIn sample)
+    {
+      if (power_ == 0)
+      {
+        top_[0] = static_cast<T>(sample);
+        return;
+      }
+
+      // the transform of a single sample is just the sample
+      Advance(0)[0] = static_cast<T>(sample);
+      if (pushed_ < Size())
+        ++pushed_;
+
+      // then build each size from the two halves below it
+      // an older half that ended before we started again is all silence
+      for (int l = 1; l <= power_; ++l)
+      {
+        int      half  = 1 << (l - 1);
+        T const* newer = Newest(l - 1);
+        T*       out   = l < power_ ? Advance(l) : top_.data();
+
+        if (pushed_ <= half)
+        {
+          for (int k = 0; k < half; ++k)
+          {
+            out[k]        =  newer[k];
+            out[k + half] = -newer[k];
+          }
+          continue;
+        }
+
+        T const* older = Oldest(l - 1);
+        for (int k = 0; k < half; ++k)
+        {
+          T a = older[k];
+          T b = newer[k];
+          out[k]        = a + b;
+          out[k + half] = a - b;
+        }
+      }
+    }
+
+  private:
+    // not copyable, we own the history
+    SlidingTransform(const SlidingTransform&);
+    SlidingTransform& operator=(const SlidingTransform&);
+
+    static const int kMaxLevels = 32;
+
+    // each level is a ring of 2^l + 1 transforms, and slot_ is the newest
+    // so the one after it is the oldest, from 2^l samples ago
+    int Slots(int l) const { return (1 << l) + 1; }
+
+    T* Entry(int l, int slot) { return history_.data() + offset_[l] + static_cast<size_t>(slot) * (1 << l); }
+
+    T* Newest(int l) { return Entry(l, slot_[l]); }
+    T* Oldest(int l) { return Entry(l, slot_[l] + 1 == Slots(l) ? 0 : slot_[l] + 1); }
+
+    // move on to the next slot (over the oldest one, which we no longer need) and return it
+    T* Advance(int l)
+    {
+      slot_[l] = slot_[l] + 1 == Slots(l) ? 0 : slot_[l] + 1;
+      return Newest(l);
+    }
+
+    int max_power_;
+    int power_;
+
+    // how many samples we've had since we started again, up to a window
+    int pushed_;
+
+    size_t offset_[kMaxLevels];
+    int    slot_[kMaxLevels];
+
+    algos::AlignedArray<T> history_;
+    algos::AlignedArray<T> top_;
+  };
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cmath>
+
+#include "cpu_features.h"
+
+#if ALGOS_X86
+  #include <emmintrin.h>
+  #if ALGOS_HAVE_AVX2 || ALGOS_HAVE_AVX512
+    #include <immintrin.h>
+  #endif
+#endif
+
+// magnitude gates: zero everything whose magnitude is below a threshold.
+// unlike selecting a fixed count, this is a single compare and mask per element,
+// with no data dependent branches or memory traffic, so it vectorizes completely.
+// the best kernels are chosen once, when we're loaded, like the fwht butterflies.
+
+namespace algos
+{
+  template <typename T>
+  struct GateKernels
+  {
+    typedef void (*Kernel)(T* data, int n, T threshold);
+
+    Kernel      gate;
+    char const* name;
+  };
+
+  template <typename T>
+  inline void GateScalar(T* data, int n, T threshold)
+  {
+    for (int i = 0; i < n; ++i)
+      data[i] = std::abs(data[i]) < threshold ? 0 : data[i];
+  }
+
+#if ALGOS_X86
+
+  // abs clears the sign bits, keep is all ones where |v| >= threshold
+  #define ALGOS_GATE_KERNEL(suffix, isa, T, V, W, set1, load, store, abs, keep)  \
+    ALGOS_TARGET(isa) inline void Gate##suffix(T* data, int n, T threshold)     \
+    {                                                                           \
+      V t = set1(threshold);                                                    \
+      int i = 0;                                                                \
+      for (; i + W <= n; i += W)                                                \
+      {                                                                         \
+        V v = load(data + i);                                                   \
+        store(data + i, keep(abs(v), t, v));                                    \
+      }                                                                         \
+      GateScalar(data + i, n - i, threshold);                                   \
+    }
+
+  #define ALGOS_ABS_SSE2_PS(v)          _mm_andnot_ps(_mm_set1_ps(-0.f), v)
+  #define ALGOS_ABS_SSE2_PD(v)          _mm_andnot_pd(_mm_set1_pd(-0.0), v)
+  #define ALGOS_KEEP_SSE2_PS(a, t, v)   _mm_and_ps(_mm_cmpge_ps(a, t), v)
+  #define ALGOS_KEEP_SSE2_PD(a, t, v)   _mm_and_pd(_mm_cmpge_pd(a, t), v)
+
+  ALGOS_GATE_KERNEL(Sse2F, "sse2", float,  __m128,  4, _mm_set1_ps, _mm_loadu_ps, _mm_storeu_ps, ALGOS_ABS_SSE2_PS, ALGOS_KEEP_SSE2_PS)
+  ALGOS_GATE_KERNEL(Sse2D, "sse2", double, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, ALGOS_ABS_SSE2_PD, ALGOS_KEEP_SSE2_PD)
+
+#if ALGOS_HAVE_AVX2
+  #define ALGOS_ABS_AVX_PS(v)           _mm256_andnot_ps(_mm256_set1_ps(-0.f), v)
+  #define ALGOS_ABS_AVX_PD(v)           _mm256_andnot_pd(_mm256_set1_pd(-0.0), v)
+  #define ALGOS_KEEP_AVX_PS(a, t, v)    _mm256_and_ps(_mm256_cmp_ps(a, t, _CMP_GE_OQ), v)
+  #define ALGOS_KEEP_AVX_PD(a, t, v)    _mm256_and_pd(_mm256_cmp_pd(a, t, _CMP_GE_OQ), v)
+
+  ALGOS_GATE_KERNEL(Avx2F, "avx2", float,  __m256,  8, _mm256_set1_ps, _mm256_loadu_ps, _mm256_storeu_ps, ALGOS_ABS_AVX_PS, ALGOS_KEEP_AVX_PS)
+  ALGOS_GATE_KERNEL(Avx2D, "avx2", double, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, ALGOS_ABS_AVX_PD, ALGOS_KEEP_AVX_PD)
+
+  #undef ALGOS_ABS_AVX_PS
+  #undef ALGOS_ABS_AVX_PD
+  #undef ALGOS_KEEP_AVX_PS
+  #undef ALGOS_KEEP_AVX_PD
+#endif
+
+#if ALGOS_HAVE_AVX512
+  // avx-512 compares into a mask register, and a zeroing move does the rest
+  #define ALGOS_KEEP_AVX512_PS(a, t, v) _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(a, t, _CMP_GE_OQ), v)
+  #define ALGOS_KEEP_AVX512_PD(a, t, v) _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(a, t, _CMP_GE_OQ), v)
+
+  ALGOS_GATE_KERNEL(Avx512F, "avx512f", float,  __m512,  16, _mm512_set1_ps, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_abs_ps, ALGOS_KEEP_AVX512_PS)
+  ALGOS_GATE_KERNEL(Avx512D, "avx512f", double, __m512d, 8,  _mm512_set1_pd, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_abs_pd, ALGOS_KEEP_AVX512_PD)
+
+  #undef ALGOS_KEEP_AVX512_PS
+  #undef ALGOS_KEEP_AVX512_PD
+#endif
+
+  #undef ALGOS_ABS_SSE2_PS
+  #undef ALGOS_ABS_SSE2_PD
+  #undef ALGOS_KEEP_SSE2_PS
+  #undef ALGOS_KEEP_SSE2_PD
+  #undef ALGOS_GATE_KERNEL
+
+#endif
+
+  // pick the widest kernel the cpu supports
+  template <typename T>
+  GateKernels<T> SelectGateKernels()
+  {
+    GateKernels<T> k = { &GateScalar<T>, "scalar" };
+    return k;
+  }
+
+  template <>
+  inline GateKernels<float> SelectGateKernels<float>()
+  {
+#if ALGOS_X86
+    CpuFeatures const& cpu = Cpu();
+  #if ALGOS_HAVE_AVX512
+    if (cpu.avx512f) { GateKernels<float> k = { &GateAvx512F, "avx512f" }; return k; }
+  #endif
+  #if ALGOS_HAVE_AVX2
+    if (cpu.avx2)    { GateKernels<float> k = { &GateAvx2F,   "avx2" };    return k; }
+  #endif
+    if (cpu.sse2)    { GateKernels<float> k = { &GateSse2F,   "sse2" };    return k; }
+#endif
+    GateKernels<float> k = { &GateScalar<float>, "scalar" };
+    return k;
+  }
+
+  template <>
+  inline GateKernels<double> SelectGateKernels<double>()
+  {
+#if ALGOS_X86
+    CpuFeatures const& cpu = Cpu();
+  #if ALGOS_HAVE_AVX512
+    if (cpu.avx512f) { GateKernels<double> k = { &GateAvx512D, "avx512f" }; return k; }
+  #endif
+  #if ALGOS_HAVE_AVX2
+    if (cpu.avx2)    { GateKernels<double> k = { &GateAvx2D,   "avx2" };    return k; }
+  #endif
+    if (cpu.sse2)    { GateKernels<double> k = { &GateSse2D,   "sse2" };    return k; }
+#endif
+    GateKernels<double> k = { &GateScalar<double>, "scalar" };
+    return k;
+  }
+
+  // the kernels in use for each type, filled in during static initialization
+  template <typename T>
+  struct GateDispatch
+  {
+    static const GateKernels<T> kernels;
+  };
+
+  template <typename T>
+  const GateKernels<T> GateDispatch<T>::kernels = SelectGateKernels<T>();
+
+  // zero every element of data[0..n) whose magnitude is below threshold
+  template <typename T>
+  inline void Gate(T* data, int n, T threshold)
+  { GateDispatch<T>::kernels.gate(data, n, threshold); }
+
+  // the root mean square of data[0..n)
+  // we keep four partial sums so the adds don't all wait on each other
+  template <typename T>
+  T Rms(T const* data, int n)
+  {
+    if (n <= 0)
+      return 0;
+
+    T sums[4] = { 0, 0, 0, 0 };
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+      sums[0] += data[i]     * data[i];
+      sums[1] += data[i + 1] * data[i + 1];
+      sums[2] += data[i + 2] * data[i + 2];
+      sums[3] += data[i + 3] * data[i + 3];
+    }
+    for (; i < n; ++i)
+      sums[0] += data[i] * data[i];
+
+    return std::sqrt((sums[0] + sums[1] + sums[2] + sums[3]) / n);
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstring>
+
+#include "aligned.h"
+
+namespace algos
+{
+  // a power-of-two ring buffer of samples, for keeping the last window of input around.
+  // writing only touches the new samples (the write index just wraps with a mask),
+  // and the last n samples are read back as up to two contiguous segments,
+  // so nothing ever has to be shifted along
+  template <typename T>
+  class RingBuffer
+  {
+  public:
+    RingBuffer() : mask_(0), write_(0) {}
+    explicit RingBuffer(int power_of_two) : mask_(0), write_(0) { Resize(power_of_two); }
+
+    // make room for 2^power_of_two samples, all 0
+    // this allocates (unless it's taken from an arena), so keep it off the audio thread
+    void Resize(int power_of_two, Arena* arena = NULL)
+    {
+      data_.Resize(static_cast<size_t>(1) << power_of_two, arena);
+      mask_  = (1 << power_of_two) - 1;
+      write_ = 0;
+    }
+
+    int Capacity() const { return mask_ + 1; }
+
+    // set everything back to 0
+    void Clear()
+    {
+      memset(data_.data(), 0, data_.size() * sizeof(T));
+      write_ = 0;
+    }
+
+    // add n samples to the end
+    // if there are more than we have room for, only the last Capacity() matter
+    template <typename TIn>
+    void Write(TIn const* input, int n)
+    {
+      if (n > Capacity())
+      {
+        input += n - Capacity();
+        n      = Capacity();
+      }
+
+      T*  data  = data_.data();
+      int first = Capacity() - write_ < n ? Capacity() - write_ : n;
+
+      for (int i = 0; i < first; ++i)
+        data[write_ + i] = static_cast<T>(input[i]);
+      for (int i = first; i < n; ++i)
+        data[i - first] = static_cast<T>(input[i]);
+
+      write_ = (write_ + n) & mask_;
+    }
+
+    // the last n (<= Capacity()) samples written, oldest first, are
+    // first[0..first_size) followed by second[0..n - first_size)
+    void Last(int n, T const** first, int* first_size, T const** second) const
+    {
+      int start = (write_ - n) & mask_;
+      *first      = data_.data() + start;
+      *first_size = Capacity() - start < n ? Capacity() - start : n;
+      *second     = data_.data();
+    }
+
+  private:
+    // not copyable, we own the samples
+    RingBuffer(const RingBuffer&);
+    RingBuffer& operator=(const RingBuffer&);
+
+    AlignedArray<T> data_;
+    int             mask_;
+    int             write_;
+  };
+}
@@ -0,0 +1,551 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#include "aligned.h"
+
+namespace algos
+{
+  // integer keys that order floating point values by magnitude
+  // with the sign bit cleared, the bits of an ieee float sort the same way as its absolute value
+  inline uint32_t MagnitudeKey(float v)
+  {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof bits);
+    return bits & 0x7fffffffu;
+  }
+
+  inline uint64_t MagnitudeKey(double v)
+  {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof bits);
+    return bits & 0x7fffffffffffffffull;
+  }
+
+  template <typename T> struct MagnitudeKeyType;
+  template <> struct MagnitudeKeyType<float>  { typedef uint32_t type; static const int kMantissaBits = 23; };
+  template <> struct MagnitudeKeyType<double> { typedef uint64_t type; static const int kMantissaBits = 52; };
+
+  // the magnitude a key came from
+  template <typename T>
+  inline T MagnitudeOf(typename MagnitudeKeyType<T>::type key)
+  {
+    T magnitude;
+    memcpy(&magnitude, &key, sizeof magnitude);
+    return magnitude;
+  }
+
+  // what we remember about one channel's last selection
+  // neighbouring frames usually look a lot alike, so the next selection can start from here
+  template <typename T>
+  struct SelectionHistory
+  {
+    typedef typename MagnitudeKeyType<T>::type Key;
+
+    SelectionHistory() : valid(false), threshold(0), mask_valid(false) {}
+
+    // make room for masks of up to max_size coefficients (from an arena if there is one)
+    void Resize(int max_size, Arena* arena = NULL) { kept.Resize(max_size, arena); Reset(); }
+
+    // forget everything, e.g. when the window size changes
+    void Reset() { valid = false; mask_valid = false; }
+
+    // the threshold of the last frame
+    bool valid;
+    Key  threshold;
+
+    // which coefficients the last frame kept, for hysteresis
+    bool                  mask_valid;
+    AlignedArray<uint8_t> kept;
+  };
+
+  // zero data[0..n) below threshold, with a hysteresis band around it:
+  // anything at or above threshold * ratio stays, anything below threshold / ratio goes,
+  // and anything in between does whatever it did last frame.
+  // that stops coefficients hovering around the threshold from flickering in and out
+  template <typename T>
+  void MaskHysteresis(T* data, int n, T threshold, double ratio, SelectionHistory<T>& history)
+  {
+    T        lo    = static_cast<T>(threshold / ratio);
+    T        hi    = static_cast<T>(threshold * ratio);
+    uint8_t* kept  = history.kept.data();
+    bool     valid = history.mask_valid;
+
+    for (int i = 0; i < n; ++i)
+    {
+      T    magnitude = std::abs(data[i]);
+      bool keep      = magnitude >= hi || (magnitude >= lo && (valid ? kept[i] != 0 : magnitude >= threshold));
+      kept[i] = keep;
+      data[i] = keep ? data[i] : 0;
+    }
+
+    history.mask_valid = true;
+  }
+
+  // finds magnitude thresholds in O(N) with a most significant digit radix select.
+  // each pass histograms one digit of the keys of the remaining candidates, picks the
+  // bucket that holds the rank we're after, and keeps only that bucket for the next pass.
+  // the first digit is (most of) the exponent, so for audio the candidates usually
+  // drop to a handful after one or two passes.
+  // a pass costs the same whatever the count (clearing and adding up every bucket), so below
+  // a few hundred it's cheaper to just nth_element (or sort) the keys, which we do for
+  // small windows, and for the candidates once the passes have got them down that far.
+  // all of the memory is allocated up front, so selecting doesn't allocate, and the
+  // histograms are only there at all if the selector's big enough to ever need them.
+  template <typename T>
+  class MagnitudeSelector
+  {
+  public:
+    typedef typename MagnitudeKeyType<T>::type Key;
+
+    MagnitudeSelector() {}
+    explicit MagnitudeSelector(int max_size) { Resize(max_size); }
+
+    // make room for up to max_size elements (from an arena if there is one)
+    void Resize(int max_size, Arena* arena = NULL)
+    {
+      int buckets = max_size > kMinPassCount ? 1 << kDigitBits : 0;
+      scratch_.Resize(max_size, arena);
+      histograms_.Resize(4 * buckets, arena);
+      energy_.Resize(buckets, arena);
+    }
+
+    // find the key of the element of data[0..n) with the given rank by magnitude
+    // (0 is the smallest), and how many elements have a strictly smaller magnitude
+    Key Select(T const* data, int n, int rank, int* less)
+    {
+      Key* candidates = scratch_.data();
+
+      // too few for a pass to be worth it
+      if (n <= kMinRadixCount)
+      {
+        for (int i = 0; i < n; ++i)
+          candidates[i] = MagnitudeKey(data[i]);
+        return Refine(candidates, n, rank, kTopShift, less);
+      }
+
+      // the first pass reads the data directly, after that we work on the candidates
+      int const* histogram = Histogram(data, n, kTopShift);
+
+      int below  = 0;
+      int bucket = FindBucket(histogram, &rank, &below);
+
+      // keep only the candidates in that bucket
+      // we always write and only advance on a match, because a branch here
+      // would be mispredicted a lot
+      int count = 0;
+      for (int i = 0; i < n; ++i)
+      {
+        Key key = MagnitudeKey(data[i]);
+        candidates[count] = key;
+        count += Digit(key, kTopShift) == bucket;
+      }
+
+      Key key = Refine(candidates, count, rank, NextShift(kTopShift), less);
+      *less += below;
+      return key;
+    }
+
+    // the same as Select, but starting from a guess at the answer, e.g. last frame's.
+    // one pass counts everything below a band around the guess and collects what's in it,
+    // and if the rank we want landed in the band we only have to refine those few.
+    // if the guess was too far off we fall back to a full select
+    Key SelectNear(T const* data, int n, int rank, int* less, Key guess)
+    {
+      Key* candidates = scratch_.data();
+
+      // a factor of two either side of the guess
+      Key span = static_cast<Key>(1) << MagnitudeKeyType<T>::kMantissaBits;
+      Key lo   = guess > span ? guess - span : 0;
+      Key hi   = guess + span;
+
+      int below = 0;
+      int count = 0;
+      for (int i = 0; i < n; ++i)
+      {
+        Key key = MagnitudeKey(data[i]);
+        below += key < lo;
+        candidates[count] = key;
+        count += key >= lo && key < hi;
+      }
+
+      if (rank < below || rank >= below + count)
+        return Select(data, n, rank, less);
+
+      Key key = Refine(candidates, count, rank - below, kTopShift, less);
+      *less += below;
+      return key;
+    }
+
+    // set the `remove` smallest magnitudes in data[0..n) to 0
+    // ties with the threshold are removed in index order until we've removed exactly `remove`.
+    // with a history, the select starts from the last frame's threshold, and a hysteresis
+    // ratio above 1 masks with a band around the threshold instead
+    // (so we no longer remove exactly `remove`)
+    void ZeroSmallest(T* data, int n, int remove, SelectionHistory<T>* history = NULL, double hysteresis = 1)
+    {
+      if (remove <= 0)
+        return;
+
+      if (remove >= n)
+      {
+        for (int i = 0; i < n; ++i)
+          data[i] = 0;
+        return;
+      }
+
+      int less;
+      Key threshold = history && history->valid
+                    ? SelectNear(data, n, remove - 1, &less, history->threshold)
+                    : Select(data, n, remove - 1, &less);
+
+      if (history)
+      {
+        history->valid     = true;
+        history->threshold = threshold;
+
+        if (hysteresis > 1)
+        {
+          MaskHysteresis(data, n, MagnitudeOf<T>(threshold), hysteresis, *history);
+          return;
+        }
+        history->mask_valid = false;
+      }
+
+      int ties = remove - less;
+
+      // everything strictly below goes, which is a straight compare and mask
+      for (int i = 0; i < n; ++i)
+        data[i] = MagnitudeKey(data[i]) < threshold ? 0 : data[i];
+
+      // then the ties, of which there are usually very few
+      for (int i = 0; i < n && ties > 0; ++i)
+      {
+        if (MagnitudeKey(data[i]) == threshold)
+        {
+          data[i] = 0;
+          --ties;
+        }
+      }
+    }
+
+    // find the smallest set of the largest magnitudes in data[0..n) that holds
+    // `fraction` of the total energy (the sum of the squares).
+    // this is the same radix walk as Select, but from the top down and weighted
+    // by energy, so after the first pass the work only depends on how many
+    // coefficients are near the boundary.
+    // returns how many are in the set (0 if none), and fills in the magnitude at the
+    // boundary and how many of the elements with exactly that magnitude are in it
+    int SelectEnergy(T const* data, int n, double fraction, Key* threshold, int* ties)
+    {
+      Key* candidates = scratch_.data();
+      int  count      = n;
+      int  shift      = kTopShift;
+      bool first      = true;
+
+      // how many are definitely above the boundary, and how much energy we still need
+      int    kept      = 0;
+      double remaining = 0;
+
+      // too few for a pass to be worth it, so they all go straight to the sort
+      if (n <= kMinEnergyRadixCount)
+      {
+        double total = 0;
+        for (int i = 0; i < n; ++i)
+        {
+          candidates[i] = MagnitudeKey(data[i]);
+          total        += Energy(candidates[i]);
+        }
+        remaining = fraction * total;
+        if (remaining <= 0 || fraction <= 0)
+          return 0;
+        first = false;
+      }
+
+      for (;;)
+      {
+        // we're down to a few, so sort them biggest first and take what we need
+        if (!first && count <= kMinEnergyRadixCount)
+        {
+          std::sort(candidates, candidates + count, std::greater<Key>());
+
+          int take = 0;
+          for (double energy = 0; take < count && energy < remaining; ++take)
+            energy += Energy(candidates[take]);
+
+          // there's always at least one, since we only get here when we needed some
+          take       = take > 0 ? take : 1;
+          *threshold = candidates[take - 1];
+          *ties      = 0;
+          for (int i = 0; i < take; ++i)
+            *ties += candidates[i] == *threshold;
+          return kept + take;
+        }
+
+        // count and sum the energy of the digits of the remaining candidates
+        int const* histogram = first ? EnergyHistogram(data, count, shift) : EnergyHistogram(candidates, count, shift);
+
+        // now we know how much we need
+        if (first)
+        {
+          double total = 0;
+          for (int b = 0; b < (1 << kDigitBits); ++b)
+            total += energy_[b];
+          remaining = fraction * total;
+
+          // asking for nothing (or there's nothing there)
+          if (remaining <= 0 || fraction <= 0)
+            return 0;
+        }
+
+        // walk down from the biggest bucket until we find the one that crosses the boundary
+        // (rounding can leave a sliver of energy still needed after the last bucket,
+        // so we never walk past the smallest one that has anything in it)
+        int lowest = 0;
+        while (histogram[lowest] == 0)
+          ++lowest;
+
+        int bucket = (1 << kDigitBits) - 1;
+        while (bucket > lowest && energy_[bucket] < remaining)
+        {
+          remaining -= energy_[bucket];
+          kept      += histogram[bucket];
+          --bucket;
+        }
+
+        // keep only the candidates in that bucket, as in Select
+        int matched = 0;
+        if (first)
+        {
+          for (int i = 0; i < count; ++i)
+          {
+            Key key = MagnitudeKey(data[i]);
+            candidates[matched] = key;
+            matched += Digit(key, shift) == bucket;
+          }
+        }
+        else
+        {
+          for (int i = 0; i < count; ++i)
+          {
+            Key key = candidates[i];
+            candidates[matched] = key;
+            matched += Digit(key, shift) == bucket;
+          }
+        }
+
+        count = matched;
+        first = false;
+
+        // everything left has the same magnitude, so we just need enough of them
+        if (shift == 0 || count == 1)
+        {
+          double each   = Energy(candidates[0]);
+          int    needed = each > 0 ? static_cast<int>(std::ceil(remaining / each)) : count;
+          *threshold = candidates[0];
+          *ties      = needed < 1 ? 1 : (needed > count ? count : needed);
+          return kept + *ties;
+        }
+
+        shift = NextShift(shift);
+      }
+    }
+
+    // zero everything except the smallest set of the largest magnitudes in data[0..n)
+    // that holds `fraction` of the total energy. returns how many were kept.
+    // a history and hysteresis ratio work the same way as in ZeroSmallest
+    int KeepEnergy(T* data, int n, double fraction, SelectionHistory<T>* history = NULL, double hysteresis = 1)
+    {
+      Key threshold;
+      int ties;
+      int kept = SelectEnergy(data, n, fraction, &threshold, &ties);
+
+      if (kept == 0)
+      {
+        for (int i = 0; i < n; ++i)
+          data[i] = 0;
+        return 0;
+      }
+
+      if (history)
+      {
+        history->valid     = true;
+        history->threshold = threshold;
+
+        if (hysteresis > 1)
+        {
+          MaskHysteresis(data, n, MagnitudeOf<T>(threshold), hysteresis, *history);
+          return kept;
+        }
+        history->mask_valid = false;
+      }
+
+      // everything strictly below goes
+      for (int i = 0; i < n; ++i)
+        data[i] = MagnitudeKey(data[i]) < threshold ? 0 : data[i];
+
+      // and the ties we don't need
+      for (int i = 0; i < n; ++i)
+      {
+        if (MagnitudeKey(data[i]) == threshold)
+        {
+          if (ties > 0)
+            --ties;
+          else
+            data[i] = 0;
+        }
+      }
+
+      return kept;
+    }
+
+  private:
+    // not copyable, we own the scratch space
+    MagnitudeSelector(const MagnitudeSelector&);
+    MagnitudeSelector& operator=(const MagnitudeSelector&);
+
+    static const int kDigitBits = 11;
+    static const int kTopShift  = static_cast<int>(sizeof(Key) * 8) - kDigitBits;
+
+    // up to how many keys nth_element beats a radix pass, and sort does for the energy
+    // select (which needs them in order), measured on the transforms of audio-like frames
+    static const int kMinRadixCount       = 512;
+    static const int kMinEnergyRadixCount = 256;
+    static const int kMinPassCount        = kMinRadixCount < kMinEnergyRadixCount ? kMinRadixCount : kMinEnergyRadixCount;
+
+    static int Digit(Key key, int shift)
+    { return static_cast<int>((key >> shift) & ((1 << kDigitBits) - 1)); }
+
+    // the last digit may overlap with the one before it, which is fine
+    // since all of the candidates agree on those bits by then
+    static int NextShift(int shift)
+    { return shift > kDigitBits ? shift - kDigitBits : 0; }
+
+    static Key KeyOf(T   value) { return MagnitudeKey(value); }
+    static Key KeyOf(Key key)   { return key; }
+
+    // the square of the magnitude a key came from
+    static double Energy(Key key)
+    {
+      double magnitude = MagnitudeOf<T>(key);
+      return magnitude * magnitude;
+    }
+
+    // find the bucket rank falls in, taking what's below it off rank and adding it to below
+    static int FindBucket(int const* histogram, int* rank, int* below)
+    {
+      int bucket = 0;
+      while (histogram[bucket] <= *rank)
+      {
+        *rank  -= histogram[bucket];
+        *below += histogram[bucket];
+        ++bucket;
+      }
+      return bucket;
+    }
+
+    // narrow candidates[0..count) down to the key with the given rank, starting from
+    // the digit at shift. less gets how many candidates are strictly smaller
+    Key Refine(Key* candidates, int count, int rank, int shift, int* less)
+    {
+      int below = 0;
+
+      for (;;)
+      {
+        // we're down to a few, so just finish them off directly
+        if (count <= kMinRadixCount)
+        {
+          std::nth_element(candidates, candidates + rank, candidates + count);
+          Key key = candidates[rank];
+          for (int i = 0; i < rank; ++i)
+            below += candidates[i] < key;
+          *less = below;
+          return key;
+        }
+
+        int const* histogram = Histogram(candidates, count, shift);
+        int        bucket    = FindBucket(histogram, &rank, &below);
+
+        // keep only the candidates in that bucket
+        // (this can be done in place, since we never write ahead of where we read)
+        int kept = 0;
+        for (int i = 0; i < count; ++i)
+        {
+          Key key = candidates[i];
+          candidates[kept] = key;
+          kept += Digit(key, shift) == bucket;
+        }
+        count = kept;
+
+        // that was the last digit, so everything left is the same key
+        if (shift == 0 || count == 1)
+        {
+          *less = below;
+          return candidates[0];
+        }
+
+        shift = NextShift(shift);
+      }
+    }
+
+    // count the digits at shift of the keys of values[0..n), and sum their energy
+    template <typename V>
+    int const* EnergyHistogram(V const* values, int n, int shift)
+    {
+      int*    histogram = histograms_.data();
+      double* energy    = energy_.data();
+      memset(histogram, 0, sizeof(int)    << kDigitBits);
+      memset(energy,    0, sizeof(double) << kDigitBits);
+
+      for (int i = 0; i < n; ++i)
+      {
+        Key key   = KeyOf(values[i]);
+        int digit = Digit(key, shift);
+        ++histogram[digit];
+        energy[digit] += Energy(key);
+      }
+
+      return histogram;
+    }
+
+    // count the digits at shift of the keys of values[0..n)
+    // audio piles most of its values into a few buckets, so we count into four
+    // separate histograms and add them up at the end, otherwise every increment
+    // would have to wait for the one before it to the same bucket
+    template <typename V>
+    int const* Histogram(V const* values, int n, int shift)
+    {
+      int* h0 = histograms_.data();
+      int* h1 = h0 + (1 << kDigitBits);
+      int* h2 = h1 + (1 << kDigitBits);
+      int* h3 = h2 + (1 << kDigitBits);
+      memset(h0, 0, 4 * sizeof(int) << kDigitBits);
+
+      int i = 0;
+      for (; i + 4 <= n; i += 4)
+      {
+        ++h0[Digit(KeyOf(values[i]),     shift)];
+        ++h1[Digit(KeyOf(values[i + 1]), shift)];
+        ++h2[Digit(KeyOf(values[i + 2]), shift)];
+        ++h3[Digit(KeyOf(values[i + 3]), shift)];
+      }
+      for (; i < n; ++i)
+        ++h0[Digit(KeyOf(values[i]), shift)];
+
+      for (int b = 0; b < (1 << kDigitBits); ++b)
+        h0[b] += h1[b] + h2[b] + h3[b];
+
+      return h0;
+    }
+
+    // the candidates, and four histograms of a digit (and the energy in each bucket of
+    // the first), which only the radix passes use
+    AlignedArray<Key>    scratch_;
+    AlignedArray<int>    histograms_;
+    AlignedArray<double> energy_;
+  };
+}
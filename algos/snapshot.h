@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+
+namespace algos
+{
+  // hands the latest version of something from one thread to another without either of
+  // them ever waiting or taking a lock. the writer fills in its own copy and swaps it into
+  // the middle, and the reader swaps the middle one out for its own when there's a newer one.
+  // with the copy in the middle neither side can ever be looking at the other's, which is why
+  // there are three rather than just a front and back buffer.
+  // there has to be exactly one writer and one reader
+  template <typename T>
+  class Snapshot
+  {
+  public:
+    Snapshot() : write_(0), middle_(1), read_(2) {}
+
+    // the writer's side: make value the latest version
+    void Write(T const& value)
+    {
+      slots_[write_] = value;
+      write_ = middle_.exchange(write_ | kFresh) & kIndex;
+    }
+
+    // the reader's side: the latest version written, which stays put until the next Read
+    // (everything before the first Write reads as a default constructed T)
+    T const& Read()
+    {
+      if (middle_.load() & kFresh)
+        read_ = middle_.exchange(read_) & kIndex;
+      return slots_[read_];
+    }
+
+  private:
+    // not copyable, the other side might be using it
+    Snapshot(const Snapshot&);
+    Snapshot& operator=(const Snapshot&);
+
+    // the middle holds the index of its copy, and whether it's newer than the reader's
+    static const int kIndex = 3;
+    static const int kFresh = 4;
+
+    T slots_[3];
+
+    int              write_;
+    std::atomic<int> middle_;
+    int              read_;
+  };
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "aligned.h"
+
+namespace algos
+{
+  // a lock-free single producer, single consumer ring of samples.
+  // one thread writes and one thread reads, and neither ever waits on the other:
+  // the writer only moves head_ and the reader only moves tail_, so all they have
+  // to agree on is those two counters. they run freely and wrap around, and the
+  // ring is a power of two so the difference between them is always the fill.
+  template <typename T>
+  class SpscRing
+  {
+  public:
+    SpscRing() : mask_(0), head_(0), tail_(0) {}
+    explicit SpscRing(int power_of_two) : mask_(0), head_(0), tail_(0) { Resize(power_of_two); }
+
+    // make room for 2^power_of_two samples, and empty it
+    // this allocates, and neither side can be using the ring while it happens
+    void Resize(int power_of_two)
+    {
+      data_.Resize(static_cast<size_t>(1) << power_of_two);
+      mask_ = (1u << power_of_two) - 1;
+      Clear();
+    }
+
+    // empty the ring. neither side can be using it while this happens
+    void Clear()
+    {
+      head_.store(0);
+      tail_.store(0);
+    }
+
+    int Capacity() const { return static_cast<int>(mask_ + 1); }
+
+    // the writer's side: how much room there is, and add up to n samples to it
+    // returns how many actually went in
+    int Space() const { return Capacity() - static_cast<int>(head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_acquire)); }
+
+    template <typename TIn>
+    int Write(TIn const* input, int n)
+    {
+      uint32_t head = head_.load(std::memory_order_relaxed);
+      int      room = Capacity() - static_cast<int>(head - tail_.load(std::memory_order_acquire));
+      n = n < room ? n : room;
+
+      T* data = data_.data();
+      for (int i = 0; i < n; ++i)
+        data[(head + i) & mask_] = static_cast<T>(input[i]);
+
+      head_.store(head + n, std::memory_order_release);
+      return n;
+    }
+
+    // the same, but n zeros
+    int WriteZeros(int n)
+    {
+      uint32_t head = head_.load(std::memory_order_relaxed);
+      int      room = Capacity() - static_cast<int>(head - tail_.load(std::memory_order_acquire));
+      n = n < room ? n : room;
+
+      T* data = data_.data();
+      for (int i = 0; i < n; ++i)
+        data[(head + i) & mask_] = 0;
+
+      head_.store(head + n, std::memory_order_release);
+      return n;
+    }
+
+    // the reader's side: how much there is to read, and take up to n samples from it
+    // returns how many actually came out
+    int Available() const { return static_cast<int>(head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_relaxed)); }
+
+    template <typename TOut>
+    int Read(TOut* output, int n)
+    {
+      uint32_t tail  = tail_.load(std::memory_order_relaxed);
+      int      avail = static_cast<int>(head_.load(std::memory_order_acquire) - tail);
+      n = n < avail ? n : avail;
+
+      T const* data = data_.data();
+      for (int i = 0; i < n; ++i)
+        output[i] = static_cast<TOut>(data[(tail + i) & mask_]);
+
+      tail_.store(tail + n, std::memory_order_release);
+      return n;
+    }
+
+    // throw away up to n samples, returns how many went
+    int Skip(int n)
+    {
+      uint32_t tail  = tail_.load(std::memory_order_relaxed);
+      int      avail = static_cast<int>(head_.load(std::memory_order_acquire) - tail);
+      n = n < avail ? n : avail;
+
+      tail_.store(tail + n, std::memory_order_release);
+      return n;
+    }
+
+  private:
+    // not copyable, we own the samples
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+
+    AlignedArray<T> data_;
+    uint32_t        mask_;
+
+    // the writer's and the reader's counters, on their own cache lines so
+    // the two threads don't keep stealing the line from each other
+    char                  pad0_[kAlignment];
+    std::atomic<uint32_t> head_;
+    char                  pad1_[kAlignment - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t> tail_;
+    char                  pad2_[kAlignment - sizeof(std::atomic<uint32_t>)];
+  };
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <Windows.h>
+#else
+  #include <cerrno>
+  #include <semaphore.h>
+#endif
+
+namespace algos
+{
+  // a counting semaphore that only goes to the os when somebody actually has to wait,
+  // so signalling it never takes a lock, and is a single atomic add unless there's a waiter
+  class Semaphore
+  {
+  public:
+    Semaphore() : count_(0)
+    {
+#if defined(_WIN32)
+      handle_ = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+#else
+      sem_init(&handle_, 0, 0);
+#endif
+    }
+
+    ~Semaphore()
+    {
+#if defined(_WIN32)
+      CloseHandle(handle_);
+#else
+      sem_destroy(&handle_);
+#endif
+    }
+
+    // let one waiter through (or the next one to come along)
+    void Signal()
+    {
+      if (count_.fetch_add(1) < 0)
+      {
+#if defined(_WIN32)
+        ReleaseSemaphore(handle_, 1, NULL);
+#else
+        sem_post(&handle_);
+#endif
+      }
+    }
+
+    // wait until we're let through
+    void Wait()
+    {
+      if (count_.fetch_sub(1) > 0)
+        return;
+#if defined(_WIN32)
+      WaitForSingleObject(handle_, INFINITE);
+#else
+      while (sem_wait(&handle_) != 0 && errno == EINTR)
+        ;
+#endif
+    }
+
+  private:
+    // not copyable, we own the os semaphore
+    Semaphore(const Semaphore&);
+    Semaphore& operator=(const Semaphore&);
+
+    // how many can go straight through, or if it's negative, how many are waiting
+    std::atomic<int> count_;
+
+#if defined(_WIN32)
+    HANDLE handle_;
+#else
+    sem_t handle_;
+#endif
+  };
+
+  // what one thread sleeps on when it runs out of work, and any number of others wake it with.
+  // waking never takes a lock, and only makes a system call if the sleeper is asleep
+  // (or just about to be), so it's safe to do from an audio thread.
+  // the sleeper arms it, checks one last time that there's nothing new, and then either
+  // sleeps or disarms it. whoever makes something new has to make it visible before they
+  // wake us, so either the sleeper sees it, or the waker sees it armed and wakes it
+  class WakeEvent
+  {
+  public:
+    WakeEvent() : armed_(false) {}
+
+    // the sleeper's side
+    void Arm() { armed_.store(true); }
+    void Sleep() { semaphore_.Wait(); }
+
+    // there was something new after all. if somebody's already woken us, we take their
+    // signal, so it doesn't wake us next time for nothing
+    void Disarm()
+    {
+      if (!armed_.exchange(false))
+        semaphore_.Wait();
+    }
+
+    // anybody's side
+    void Wake()
+    {
+      if (armed_.exchange(false))
+        semaphore_.Signal();
+    }
+
+  private:
+    // not copyable, we own the semaphore
+    WakeEvent(const WakeEvent&);
+    WakeEvent& operator=(const WakeEvent&);
+
+    std::atomic<bool> armed_;
+    Semaphore         semaphore_;
+  };
+}
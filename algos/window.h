@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cmath>
+
+#include "aligned.h"
+
+namespace algos
+{
+  // square rooted periodic hann windows for every power of two size up to a maximum.
+  // we use the same window for analysis and synthesis, so what comes out of a frame
+  // has been through a hann window, and hann windows overlapped by 2 or more add up
+  // to a constant (overlap / 2). they're all computed up front (2^(max_power + 1)
+  // elements in total), so changing the window size never has to compute anything.
+  // bigger ones can be added later with Build, which allocates, and like the plans
+  // they never move once they're built
+  template <typename T>
+  class SqrtHannWindows
+  {
+  public:
+    static const int kMaxWindowPower = 30;
+
+    explicit SqrtHannWindows(int max_power) : max_power_(max_power), data_(static_cast<size_t>(2) << max_power)
+    {
+      // the window of size 2^power lives at offset 2^power
+      for (int power = 0; power <= max_power; ++power)
+        Fill(data_.data() + (1 << power), 1 << power);
+    }
+
+    // compute the window for 2^power samples, if there isn't one already
+    void Build(int power)
+    {
+      if (power <= max_power_ || large_[power].size() > 0)
+        return;
+      large_[power].Resize(static_cast<size_t>(1) << power);
+      Fill(large_[power].data(), 1 << power);
+    }
+
+    // the window for 2^power samples
+    T const* Get(int power) const { return power <= max_power_ ? data_.data() + (1 << power) : large_[power].data(); }
+
+    // what to scale the overlapped output by so it adds back up to the input
+    // (this is only right for an overlap of 2 or more)
+    static T Gain(int overlap) { return static_cast<T>(2) / overlap; }
+
+  private:
+    // not copyable, we own the tables
+    SqrtHannWindows(const SqrtHannWindows&);
+    SqrtHannWindows& operator=(const SqrtHannWindows&);
+
+    static void Fill(T* window, int N)
+    {
+      const double kPi = 3.14159265358979323846;
+      for (int i = 0; i < N; ++i)
+        window[i] = static_cast<T>(std::sqrt(0.5 - 0.5 * std::cos(2 * kPi * i / N)));
+    }
+
+    int             max_power_;
+    AlignedArray<T> data_;
+    AlignedArray<T> large_[kMaxWindowPower + 1];
+  };
+}
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "aligned.h"
+#include "cpu_features.h"
+#include "wake.h"
+
+#if ALGOS_X86
+  #include <emmintrin.h>
+#endif
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <Windows.h>
+#endif
+
+namespace algos
+{
+  // let the other hyperthread on this core have a go while we spin
+  inline void CpuRelax()
+  {
+#if ALGOS_X86
+    _mm_pause();
+#endif
+  }
+
+  // the affinity mask of every physical core, so we can put one thread on each
+  // (hyperthreads share a core's execution units, so a second thread there mostly just
+  // gets in the way of the first). where we can't find out, we fall back to one entry
+  // per logical processor, with a mask of 0 for don't pin
+  inline std::vector<uint64_t> PhysicalCores()
+  {
+    std::vector<uint64_t> cores;
+
+#if defined(_WIN32)
+    DWORD length = 0;
+    GetLogicalProcessorInformation(NULL, &length);
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (!info.empty() && GetLogicalProcessorInformation(&info[0], &length))
+    {
+      for (size_t i = 0; i < info.size(); ++i)
+        if (info[i].Relationship == RelationProcessorCore)
+          cores.push_back(static_cast<uint64_t>(info[i].ProcessorMask));
+    }
+#endif
+
+    if (cores.empty())
+      cores.resize(std::max(std::thread::hardware_concurrency(), 1u), 0);
+    return cores;
+  }
+
+  // a fixed set of worker threads shared by any number of clients (instances of the plugin),
+  // each of which splits its callback's work up into tasks.
+  // the threads are created by Start (so not on an audio thread), and after that
+  // Run never takes a lock or allocates, and only makes a system call to wake a worker
+  // that's gone to sleep. idle workers spin for a few microseconds waiting for the next job,
+  // which catches the rest of a callback's work without keeping every core busy between
+  // callbacks, and only then go to sleep on a WakeEvent of their own.
+  //
+  // every client has its own slot holding its current job, and the workers steal tasks
+  // from whichever slots have some. the client's own thread works through its job too,
+  // so a client never has to wait for anyone else's work, only for tasks of its own that
+  // a worker already has. on top of that, the workers are fair about which slot they take
+  // from: the job with the earliest deadline goes first, but no client gets more than its
+  // share of the workers while other clients have work waiting, so one heavy instance
+  // can't take every thread for itself
+  class WorkerPool
+  {
+  public:
+    // run task(context, i) for every i in [0, count)
+    typedef void (*Task)(void* context, int index);
+
+    // how many clients can share the pool at once
+    static const int kMaxClients = 128;
+
+    WorkerPool() : posted_(0), parked_(0), stop_(false), num_clients_(0) {}
+    ~WorkerPool() { Stop(); }
+
+    // start a worker for every affinity mask, pinned to it (stopping any that are already running)
+    // a mask of 0 leaves that worker wherever the os wants to put it
+    void Start(std::vector<uint64_t> const& masks)
+    {
+      Stop();
+      stop_ = false;
+      wakes_.reset(new WakeEvent[masks.size()]);
+      threads_.reserve(masks.size());
+      for (size_t i = 0; i < masks.size(); ++i)
+      {
+        threads_.push_back(std::thread(&WorkerPool::Work, this, static_cast<int>(i)));
+#if defined(_WIN32)
+        if (masks[i] != 0)
+          SetThreadAffinityMask(threads_.back().native_handle(), static_cast<DWORD_PTR>(masks[i]));
+#endif
+      }
+    }
+
+    // start num_threads workers, without pinning them
+    void Start(int num_threads)
+    { Start(std::vector<uint64_t>(num_threads, 0)); }
+
+    // stop and join all of the workers
+    void Stop()
+    {
+      if (threads_.empty())
+        return;
+
+      stop_ = true;
+      WakeAll();
+
+      for (size_t i = 0; i < threads_.size(); ++i)
+        threads_[i].join();
+      threads_.clear();
+    }
+
+    int Threads() const { return static_cast<int>(threads_.size()); }
+
+    // take a slot to run jobs in, returns -1 if they're all taken
+    int Join()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int i = 0; i < kMaxClients; ++i)
+      {
+        if (!clients_[i].used)
+        {
+          clients_[i].used = true;
+          if (i >= num_clients_.load())
+            num_clients_.store(i + 1);
+          return i;
+        }
+      }
+      return -1;
+    }
+
+    // give a slot back. its client can't be in the middle of a Run
+    void Leave(int client)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      clients_[client].used = false;
+    }
+
+    // a time on the clock the deadlines are measured with, in microseconds
+    static int64_t Now()
+    {
+      return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // run task(context, i) for every i in [0, count) on the workers and the calling thread,
+    // and return once they've all finished. count has to be less than 2^16.
+    // the deadline (from Now()) is when the client needs it done by, which decides
+    // whose tasks the workers take first
+    void Run(int client, Task task, void* context, int count, int64_t deadline)
+    {
+      Client& c = clients_[client];
+      c.task      = task;
+      c.context   = context;
+      c.remaining = count;
+      c.deadline  = deadline;
+
+      // publish the job: a new generation, its count, and the next index to hand out
+      uint64_t generation = (c.claim.load() >> 32) + 1;
+      c.claim.store((generation << 32) | (static_cast<uint64_t>(count) << 16));
+
+      // and let the workers know there's something new
+      posted_.fetch_add(1);
+      if (parked_.load() > 0)
+        WakeAll();
+
+      // help out, then wait for whatever the workers are still busy with
+      while (Claim(c))
+        ;
+      while (c.remaining.load() > 0)
+        CpuRelax();
+    }
+
+  private:
+    // not copyable, we own the threads
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+    // how long an idle worker checks for a new job before it parks, in microseconds
+    static const int kSpinMicros = 5;
+
+    // a client's current job, on its own cache lines so clients don't slow each other down
+    struct Client
+    {
+      Client() : claim(0), remaining(0), running(0), deadline(0), task(NULL), context(NULL), used(false) {}
+
+      // generation << 32 | count << 16 | next index
+      std::atomic<uint64_t> claim;
+      std::atomic<int>      remaining;
+
+      // how many threads are running its tasks right now
+      std::atomic<int>      running;
+      std::atomic<int64_t>  deadline;
+
+      Task  task;
+      void* context;
+      bool  used;
+
+      char pad[kAlignment];
+    };
+
+    // whether a client has a task nobody has claimed yet
+    static bool Pending(Client const& c)
+    {
+      uint64_t claim = c.claim.load();
+      return (claim & 0xffff) < ((claim >> 16) & 0xffff);
+    }
+
+    // claim and run one task from a client's job, returns false if there were none left.
+    // claiming is a compare and swap on the whole job word, so a worker that's late
+    // can never claim a task from a job that's already finished: any index it manages
+    // to claim belongs to the job that's running now, whose task and context are still set
+    bool Claim(Client& c)
+    {
+      for (;;)
+      {
+        uint64_t claim = c.claim.load();
+        int      count = static_cast<int>((claim >> 16) & 0xffff);
+        int      index = static_cast<int>(claim & 0xffff);
+        if (index >= count)
+          return false;
+
+        if (c.claim.compare_exchange_weak(claim, claim + 1))
+        {
+          c.running.fetch_add(1);
+          c.task(c.context, index);
+          c.running.fetch_sub(1);
+          c.remaining.fetch_sub(1);
+          return true;
+        }
+      }
+    }
+
+    // wake every worker that's asleep (the ones that aren't just ignore it)
+    void WakeAll()
+    {
+      for (size_t i = 0; i < threads_.size(); ++i)
+        wakes_[i].Wake();
+    }
+
+    // pick the client a worker should take a task from next, or -1 if nobody has any.
+    // earliest deadline first, among the clients that have fewer than their share of the
+    // workers, and if they all have their share, among everybody so nobody sits idle
+    int Choose(int worker)
+    {
+      int clients = num_clients_.load();
+      int waiting = 0;
+      for (int i = 0; i < clients; ++i)
+        waiting += Pending(clients_[i]);
+      if (waiting == 0)
+        return -1;
+
+      int share = std::max(Threads() / waiting, 1);
+
+      int     fair      = -1;
+      int     any       = -1;
+      int64_t fair_when = 0;
+      int64_t any_when  = 0;
+
+      // start from a different place for every worker, so ties spread out
+      for (int n = 0; n < clients; ++n)
+      {
+        int     i = (worker + n) % clients;
+        Client& c = clients_[i];
+        if (!Pending(c))
+          continue;
+
+        int64_t when = c.deadline.load();
+        if (any < 0 || when < any_when)
+        {
+          any      = i;
+          any_when = when;
+        }
+        if (c.running.load() < share && (fair < 0 || when < fair_when))
+        {
+          fair      = i;
+          fair_when = when;
+        }
+      }
+      return fair >= 0 ? fair : any;
+    }
+
+    void Work(int worker)
+    {
+      for (;;)
+      {
+        // anything posted after this will change it, so we can't miss it while we look
+        uint64_t seen = posted_.load();
+
+        int client = Choose(worker);
+        if (client >= 0)
+        {
+          Claim(clients_[client]);
+          continue;
+        }
+
+        // spin a little while for the next job
+        int64_t until = Now() + kSpinMicros;
+        while (posted_.load() == seen && !stop_.load() && Now() < until)
+          CpuRelax();
+
+        // then sleep until there is one. we count ourselves as parked before we look one
+        // last time, so Run either sees us parked and wakes us, or we see its job
+        if (posted_.load() == seen && !stop_.load())
+        {
+          parked_.fetch_add(1);
+          wakes_[worker].Arm();
+          if (posted_.load() == seen && !stop_.load())
+            wakes_[worker].Sleep();
+          else
+            wakes_[worker].Disarm();
+          parked_.fetch_sub(1);
+        }
+
+        if (stop_.load())
+          return;
+      }
+    }
+
+    Client clients_[kMaxClients];
+
+    // how many jobs have been posted, which is what idle workers wait on
+    std::atomic<uint64_t> posted_;
+    std::atomic<int>      parked_;
+    std::atomic<bool>     stop_;
+
+    // one past the highest slot that's ever been used, so the workers don't look at the rest
+    std::atomic<int>      num_clients_;
+
+    // what each worker sleeps on when there's nothing to do
+    std::unique_ptr<WakeEvent[]> wakes_;
+
+    // only for joining and leaving, never taken by Run
+    std::mutex               mutex_;
+    std::vector<std::thread> threads_;
+  };
+}
@@ -1,126 +1,748 @@
 #define _USE_MATH_DEFINES
 
 #include <algorithm>
+#include <climits>
 #include <cmath>
 
-#include "algos/fwht.h"
 #include "walshing_machine.h"
 
+std::atomic<unsigned> WalshingMachine::instance_count_(0);
+
+algos::WorkerPool* WalshingMachine::shared_workers_ = NULL;
+int                WalshingMachine::shared_users_   = 0;
+std::mutex         WalshingMachine::shared_mutex_;
+
+WalshingMachine::Tables* WalshingMachine::shared_tables_       = NULL;
+int                      WalshingMachine::shared_tables_users_ = 0;
+
+void WalshingMachine::JoinTables()
+{
+  std::lock_guard<std::mutex> lock(shared_mutex_);
+  if (shared_tables_users_++ == 0)
+    shared_tables_ = new Tables;
+  tables_ = shared_tables_;
+
+  wide_.tables   = &tables_->wide;
+  narrow_.tables = &tables_->narrow;
+}
+
+void WalshingMachine::LeaveTables()
+{
+  std::lock_guard<std::mutex> lock(shared_mutex_);
+  tables_        = NULL;
+  wide_.tables   = NULL;
+  narrow_.tables = NULL;
+  if (--shared_tables_users_ == 0)
+  {
+    delete shared_tables_;
+    shared_tables_ = NULL;
+  }
+}
+
+void WalshingMachine::BuildTables(int power)
+{
+  std::lock_guard<std::mutex> lock(shared_mutex_);
+  for (int p = kMaxWinPower + 1; p <= power; ++p)
+  {
+    if (UseFloats())
+      tables_->narrow.Build(p);
+    else
+      tables_->wide.Build(p);
+  }
+}
+
+void WalshingMachine::JoinWorkers()
+{
+  std::lock_guard<std::mutex> lock(shared_mutex_);
+
+  // one pinned thread per physical core but one, since whoever runs a job works through
+  // it too, so that's a thread per core between them
+  if (shared_users_++ == 0)
+  {
+    std::vector<uint64_t> cores = algos::PhysicalCores();
+    cores.pop_back();
+    shared_workers_ = new algos::WorkerPool;
+    shared_workers_->Start(cores);
+  }
+
+  workers_ = shared_workers_;
+  client_  = workers_->Join();
+}
+
+void WalshingMachine::LeaveWorkers()
+{
+  std::lock_guard<std::mutex> lock(shared_mutex_);
+  if (!workers_)
+    return;
+
+  if (client_ >= 0)
+    workers_->Leave(client_);
+  workers_ = NULL;
+  client_  = -1;
+
+  if (--shared_users_ == 0)
+  {
+    delete shared_workers_;
+    shared_workers_ = NULL;
+  }
+}
+
 void WalshingMachine::processReplacing(float** inputs, float** outputs, VstInt32 sampleFrames)
 { process<float>(inputs, outputs, sampleFrames); }
 
 void WalshingMachine::processDoubleReplacing(double** inputs, double** outputs, VstInt32 sampleFrames)
 { process<double>(inputs, outputs, sampleFrames); }
 
-template <typename TIn, typename TOut>
-void WalshingMachine::walsh(TIn* input, TOut* output)
+void WalshingMachine::Publish(bool restart)
 {
-  // get the window size
-  int win_pow  = GetWindowPower();
-  int win_size = GetWindowSize();
-  
-  // perform the transform
-  fwht::SequencyOrdered<TIn, double>(input, win_pow, coeffs_);
+  std::lock_guard<std::mutex> lock(publish_mutex_);
 
-  // perform the filtering by zeroing out bins below the high pass and above the low pass
+  // if the window's bigger than we have room for, the background thread makes some,
+  // and in the meantime we stay as big as we can
+  grow_to_.store(GetWantedPower());
+  slide_to_.store(GetSlidingPower());
+
+  Settings s;
+  s.win_power = GetWindowPower();
+  s.win_size  = GetWindowSize();
+  s.hop_size  = GetHopSize();
+  s.overlap   = GetOverlap();
+  for (int i = 0; i < kNumInputs; ++i)
+    s.phase[i] = GetPhase(i);
+  s.sliding   = UseSliding();
+  s.threads   = UseThreads();
+  s.split     = UseSplit();
+  s.async     = UseAsync();
+  s.latency   = GetLatency();
+
+  s.wanted_power = grow_to_.load();
+
+  // the filter cuts off by zeroing out bins below the high pass and above the low pass
   // since idx * sample_rate / 2 / win_size = Freq,
   // idx = freq * 2 * win_size / sample_rate
-  int hp_cut_idx = static_cast<int>((win_size<<1) * FilterToHz(params_[kHPFreq]) / getSampleRate());
-  int lp_cut_idx = static_cast<int>((win_size<<1) * FilterToHz(params_[kLPFreq]) / getSampleRate());
-  for (int k = 0; k < win_size; ++k)
-    coeffs_[k] *= (k >= hp_cut_idx) && (k <= lp_cut_idx);
+  s.hp_cut_idx = static_cast<int>((s.win_size<<1) * FilterToHz(params_[kHPFreq]) / getSampleRate());
+  s.lp_cut_idx = static_cast<int>((s.win_size<<1) * FilterToHz(params_[kLPFreq]) / getSampleRate());
 
-  // create the sorted coeffs, which consist of the absolute value of the coefficient
-  // we don't care about its +- value
-  for (int k = 0; k < win_size; ++k)
-    sort_coeffs_[k] = Coeff(k, coeffs_[k]);
+  // convert the amount to make the knob more active, and choose how many to remove
+  double adj_amount = pow(static_cast<double>(params_[kLoss]), static_cast<double>(1) / kAmountRoot);
+  s.loss_mode      = GetLossMode();
+  s.remove         = static_cast<int>(adj_amount * (s.win_size - 1));
+  s.gate_threshold = GateThreshold();
+  s.rms_ratio      = GateRmsRatio();
+  s.energy_kept    = EnergyKept();
+  s.hysteresis     = Hysteresis();
 
-  // sort the coeffs
-  std::sort(sort_coeffs_, sort_coeffs_ + win_size);
+  s.normalize = params_[kNormliz];
+  s.dry       = 1 - params_[kDryWet];
+  s.wet       = params_[kDryWet];
 
-  // convert the amount to make the knob more active
-  double adj_amount = pow(static_cast<double>(params_[kLoss]), static_cast<double>(1) / kAmountRoot);
+  // going in or out of the background thread hands the channels over, which can only
+  // be done from scratch. anything else that changes the shape of the frames gets a new
+  // layout, which the engines crossfade over to. the engine we'd crossfade to only has
+  // room for the real time windows (see Place), so a new layout on an offline window
+  // starts from scratch too, which nobody's listening to anyway
+  bool same_phases = true;
+  for (int i = 0; i < kNumInputs; ++i)
+    same_phases = same_phases && s.phase[i] == published_.phase[i];
+  bool new_layout = !same_phases || s.win_power != published_.win_power || s.hop_size != published_.hop_size ||
+                    s.overlap != published_.overlap || s.sliding != published_.sliding;
+
+  restart = restart || s.async != published_.async || (new_layout && s.win_power > kMaxWinPower);
+  if (restart)
+    ++epoch_;
+  s.epoch = epoch_;
+
+  if (restart || new_layout)
+    ++layout_;
+  s.layout = layout_;
+
+  // the background thread's first, so by the time the audio thread asks it to start
+  // again at this epoch, it's guaranteed to have the settings for it
+  async_settings_.Write(s);
+  settings_.Write(s);
+
+  published_ = s;
+  latency_.store(s.latency);
+
+  // it might have something to do about them (like making room for them)
+  WakeBackground();
+}
+
+void WalshingMachine::Place(algos::Arena& arena, int power, int sliding_power)
+{
+  if (UseFloats())
+  {
+    Place(narrow_, arena, power, sliding_power);
+    Drop(wide_);
+  }
+  else
+  {
+    Place(wide_, arena, power, sliding_power);
+    Drop(narrow_);
+  }
+}
+
+template <typename S>
+void WalshingMachine::Drop(Core<S>& c)
+{
+  // laying it out in an arena with no block leaves every buffer empty
+  algos::Arena none;
+  Place(c, none, 0, 0);
+}
 
-  // choose how many to remove
-  int remove = static_cast<int>(adj_amount * (win_size - 1));
+template <typename S>
+void WalshingMachine::Place(Core<S>& c, algos::Arena& arena, int power, int sliding_power)
+{
+  // everything a channel uses together sits together
+  int size = 1 << power;
 
-  // set the amplitude to 0 for the ones to remove
-  // we don't want to set everything to 0, because then we lose the indices
-  for (int i = 0; i < remove; ++i)
-    sort_coeffs_[i].val = 0;
+  arena.Rewind();
+  for (int i = 0; i < kNumInputs; ++i)
+  {
+    Channel<S>& ch = c.channels[i];
+    ch.coeffs = arena.Take<S>(size);
+    ch.selector.Resize(size, &arena);
+    ch.input_ring.Resize(power, &arena);
+  }
 
-  // copy back to the coeffs
+  // the second engine is only ever crossfaded to, which the offline windows don't do
+  // (they start again from scratch, see Publish), so it only needs room for the real
+  // time ones. starting again always goes back to the first one
+  for (int e = 0; e < 2; ++e)
+  {
+    int lane_size = e == 0 ? size : 1 << std::min(power, static_cast<int>(kMaxWinPower));
+    for (int i = 0; i < kNumInputs; ++i)
+    {
+      Lane<S>& l = c.engines[e].lanes[i];
+      l.output_queue = arena.Take<S>(lane_size);
+      l.output_buf   = arena.Take<S>(lane_size);
+      l.history.Resize(lane_size, &arena);
+      l.sliding.Resize(sliding_power, &arena);
+    }
+  }
+}
+
+bool WalshingMachine::Allocate(int power, int sliding_power)
+{
+  std::lock_guard<std::mutex> lock(arena_mutex_);
+
+  // the offline windows can be big enough that we might not get them, so we don't
+  // let go of what we have until we know we've got the new one
+  sliding_power = std::min(sliding_power, power);
+  algos::Arena arena;
+  arena.Reserve(ArenaBytes(power, sliding_power));
+  if (arena.Size() < ArenaBytes(power, sliding_power))
+  {
+    too_big_.store(std::min(too_big_.load(), power));
+    return false;
+  }
+  BuildTables(power);
+
+  size_t old = arena_.Size();
+  arena_.Swap(arena);
+  arena.Free();
+  footprint_ += arena_.Size();
+  footprint_ -= old;
+
+  Place(arena_, power, sliding_power);
+  arena_power_ = power;
+  arena_slide_ = sliding_power;
+
+  // a spare that's ready was made to go with the old arena (maybe in the other precision),
+  // so it's no use to us now. we've got the channels, so it's ours to free
+  if (spare_ready_.load())
+  {
+    footprint_ -= spare_.Size();
+    spare_.Free();
+    spare_ready_.store(false);
+  }
+  capacity_.store(power);
+  slide_capacity_.store(sliding_power);
+  return true;
+}
+
+template <typename S>
+bool WalshingMachine::Fits(Core<S>& c, Settings const& s)
+{
+  if (Room(s, arena_power_, arena_slide_))
+    return true;
+  if (!spare_ready_.load() || !Room(s, spare_power_, spare_slide_))
+    return false;
+
+  Grow(c);
+  return true;
+}
+
+template <typename S>
+void WalshingMachine::Grow(Core<S>& c)
+{
+  // note where everything we're carrying over is in the old arena
+  struct Carried
+  {
+    S const*       first;
+    int            first_size;
+    S const*       second;
+    S const*       queue;
+    S const*       sum;
+    uint8_t const* kept;
+    bool           valid;
+    bool           mask_valid;
+    typename algos::SelectionHistory<S>::Key threshold;
+  };
+
+  Engine<S>& e        = c.engines[active_];
+  int        win_size = e.settings.win_size;
+  int        real     = std::min(history_, c.channels[0].input_ring.Capacity());
+  Carried    carried[kNumInputs];
+  for (int i = 0; i < kNumInputs; ++i)
+  {
+    Carried&                          from    = carried[i];
+    Lane<S> const&                    l       = e.lanes[i];
+    algos::SelectionHistory<S> const& history = l.history;
+    c.channels[i].input_ring.Last(real, &from.first, &from.first_size, &from.second);
+    from.queue      = l.output_queue;
+    from.sum        = l.output_buf;
+    from.kept       = history.kept.data();
+    from.valid      = history.valid;
+    from.mask_valid = history.mask_valid;
+    from.threshold  = history.threshold;
+  }
+
+  // take the spare, and leave our old arena for the background thread to free
+  arena_.Swap(spare_);
+  std::swap(arena_power_, spare_power_);
+  std::swap(arena_slide_, spare_slide_);
+  Place(c, arena_, arena_power_, arena_slide_);
+
+  for (int i = 0; i < kNumInputs; ++i)
+  {
+    Carried const& from = carried[i];
+    Lane<S>&       l    = e.lanes[i];
+    c.channels[i].input_ring.Write(from.first,  from.first_size);
+    c.channels[i].input_ring.Write(from.second, real - from.first_size);
+    memcpy(l.output_queue,       from.queue, win_size * sizeof(S));
+    memcpy(l.output_buf,         from.sum,   win_size * sizeof(S));
+    memcpy(l.history.kept.data(), from.kept, win_size);
+    l.history.valid      = from.valid;
+    l.history.mask_valid = from.mask_valid;
+    l.history.threshold  = from.threshold;
+  }
+
+  // the sliding transforms don't come with us (they're N^2/3 each, far too much to copy
+  // here), but we only grow on the way to a new layout or starting again, so all this
+  // engine has left is the crossfade, and it can do whole transforms from the rings until then
+  e.settings.sliding = false;
+  history_           = real;
+
+  spare_ready_.store(false);
+  WakeBackground();
+}
+
+bool WalshingMachine::Prepare()
+{
+  // only the background thread gets here. once the spare's ready it's the channels',
+  // and the audio thread grows into it when it sees spare_ready_, so we leave it alone.
+  // the lock is only for Allocate, which can be making a new arena on the host's thread
+  if (spare_ready_.load())
+    return false;
+  std::lock_guard<std::mutex> lock(arena_mutex_);
+
+  // the spare keeps room for everything the arena has, as well as what we've been asked for
+  int  power   = grow_to_.load();
+  int  sliding = slide_to_.load();
+  bool bigger  = power > capacity_.load() && power < too_big_.load();
+  if (bigger || sliding > slide_capacity_.load())
+  {
+    power   = bigger ? power : capacity_.load();
+    sliding = std::min(std::max(sliding, slide_capacity_.load()), power);
+
+    size_t old = spare_.Size();
+    spare_.Reserve(ArenaBytes(power, sliding));
+    footprint_ += spare_.Size();
+    footprint_ -= old;
+
+    // the offline windows can be big enough that we might not get them, in which case
+    // the settings stay as big as we've got
+    if (spare_.Size() < ArenaBytes(power, sliding))
+    {
+      if (bigger)
+        too_big_.store(std::min(too_big_.load(), power));
+      footprint_ -= spare_.Size();
+      spare_.Free();
+      return false;
+    }
+    BuildTables(power);
+
+    spare_power_ = power;
+    spare_slide_ = sliding;
+    spare_ready_.store(true);
+
+    // now the settings can have the window they asked for. that can change our latency,
+    // which the host hears about the next time it calls us (see ReportLatency)
+    int capacity = capacity_.load();
+    while (capacity < power && !capacity_.compare_exchange_weak(capacity, power))
+      ;
+    int slide_capacity = slide_capacity_.load();
+    while (slide_capacity < sliding && !slide_capacity_.compare_exchange_weak(slide_capacity, sliding))
+      ;
+    Publish(false);
+    return true;
+  }
+
+  if (spare_.Size() > 0)
+  {
+    footprint_ -= spare_.Size();
+    spare_.Free();
+  }
+  return false;
+}
+
+void WalshingMachine::StartBackground()
+{
+  if (async_running_.load())
+    return;
+
+  std::lock_guard<std::mutex> lock(async_mutex_);
+  if (async_running_.load() || !async_open_)
+    return;
+  async_thread_ = std::thread(&WalshingMachine::async_work, this);
+  async_running_.store(true);
+}
+
+void WalshingMachine::TakeChannels()
+{
+  if (!async_running_.load())
+    return;
+  async_owner_ = 0;
+  RequestChannels(false);
+  unsigned want = async_want_.load();
+  while (async_have_.load() != want)
+    std::this_thread::yield();
+}
+
+void WalshingMachine::GiveChannels()
+{
+  handover_gain_ = kCrossfade;
+  handover_hold_ = 0;
+
+  // the settings are the audio thread's to read, so we go by what was published
+  unsigned owner;
+  {
+    std::lock_guard<std::mutex> lock(publish_mutex_);
+    owner = published_.async ? (published_.epoch << 1) | 1 : 0;
+  }
+  if (owner == async_owner_)
+    return;
+
+  async_owner_ = owner;
+  RequestChannels(true);
+  unsigned want = async_want_.load();
+  while (async_have_.load() != want)
+    std::this_thread::yield();
+}
+
+template <typename TIn, typename S>
+void WalshingMachine::walsh(Core<S>& c, Engine<S>& e, int channel, TIn const* first, int first_size, TIn const* second, S const* taper, int64_t deadline)
+{
+  fwht::Plan<S>& plan   = c.tables->plans.Get(e.settings.win_power);
+  S*             coeffs = c.channels[channel].coeffs;
+  SplitPool      pool   = { this, deadline };
+  
+  // perform the transform
+  // we work in natural order, which needs no reordering going in or out.
+  // everything below only cares about magnitudes, except for the filtering,
+  // which looks up each coefficient's sequency index instead
+  if (e.settings.split)
+    plan.Forward(first, first_size, second, coeffs, fwht::kNatural, taper, pool);
+  else
+    plan.Forward(first, first_size, second, coeffs, fwht::kNatural, taper);
+
+  // do everything we do to the coefficients
+  shape(c, e, channel);
+
+  // invert back in place
+  if (e.settings.split)
+    plan.Inverse(coeffs, coeffs, fwht::kNatural, pool);
+  else
+    plan.Inverse(coeffs, coeffs, fwht::kNatural);
+}
+
+template <typename S>
+void WalshingMachine::shape(Core<S>& c, Engine<S>& e, int channel)
+{
+  Settings const& s    = e.settings;
+  Channel<S>&     ch   = c.channels[channel];
+  fwht::Plan<S>&  plan = c.tables->plans.Get(s.win_power);
+
+  // get the window size from the plan, so that it always matches the tables
+  int             win_size = plan.Size();
+  uint32_t const* sequency = plan.SequencyIndex();
+  S*              coeffs   = ch.coeffs;
+
+  // perform the filtering by zeroing out bins below the high pass and above the low pass
   for (int k = 0; k < win_size; ++k)
-    coeffs_[sort_coeffs_[k].idx] = sort_coeffs_[k].val;
+    coeffs[k] *= (static_cast<int>(sequency[k]) >= s.hp_cut_idx) && (static_cast<int>(sequency[k]) <= s.lp_cut_idx);
+
+  // remove the coefficients we don't want
+  // neighbouring frames of a channel usually look alike, so the count and energy selects
+  // start from where the last frame ended up, and the hysteresis band (if any) keeps
+  // coefficients near the threshold from flickering in and out from frame to frame
+  algos::SelectionHistory<S>& history = e.lanes[channel].history;
+  double hysteresis = s.hysteresis;
+  switch (s.loss_mode)
+  {
+  // set the amplitude to 0 for the ones with the smallest magnitudes
+  // we only need to know the magnitude of the last one to remove, not the full order,
+  // so this is a linear time select rather than a sort
+  case kLossCount:
+    ch.selector.ZeroSmallest(coeffs, win_size, s.remove, &history, hysteresis);
+    break;
+
+  // the gates don't care how many coefficients go, just how big they are,
+  // so they're a single compare and mask over the coefficients
+  case kLossGate:
+  case kLossRmsGate:
+    {
+      S threshold = static_cast<S>(s.loss_mode == kLossGate ? s.gate_threshold : algos::Rms(coeffs, win_size) * s.rms_ratio);
+      if (hysteresis > 1)
+        algos::MaskHysteresis(coeffs, win_size, threshold, hysteresis, history);
+      else
+      {
+        algos::Gate(coeffs, win_size, threshold);
+        history.mask_valid = false;
+      }
+    }
+    break;
+
+  // keep the fewest coefficients that hold the energy we want
+  // for sparse material that's very few, and the select only has to look closely
+  // at the ones near the boundary
+  case kLossEnergy:
+    ch.selector.KeepEnergy(coeffs, win_size, s.energy_kept, &history, hysteresis);
+    break;
+  }
 
   // perform the normalization
   
   // get the sum of the absolute coefficients
+  // (in doubles, even when the coefficients are floats, so a big window's sum stays exact enough)
   double sum = 0;
   for (int k = 0; k < win_size; ++k)
-    sum += std::abs(coeffs_[k]);
+    sum += std::abs(coeffs[k]);
 
   // if we have full normalization, we divide all coefficients by the sum 
   // to make them sum to 1. if we have no normalization, we leave them as they are
   // (or divide by 1)
-  double div = 1 * (1 - params_[kNormliz]) + sum * params_[kNormliz];
+  S div = static_cast<S>(1 * (1 - s.normalize) + sum * s.normalize);
   for (int k = 0; k < win_size; ++k)
-    coeffs_[k] /= div;
-
-  // invert back to the output buffer
-  fwht::SequencyOrderedInverse<double, TOut>(coeffs_, win_pow, output);
+    coeffs[k] /= div;
 }
 
-template <typename T> 
-void WalshingMachine::process(T** inputs, T** outputs, VstInt32 sampleFrames)
+template <typename S>
+void WalshingMachine::slide_frame(Core<S>& c, Engine<S>& e, int channel)
 {
-  // TWO CASES:
-  
-  // 1. sampleFrames is >= our window size
-  // In this case, we don't need a running buffer or anything -- we have all the information
-  // we need present within the input
-  if (sampleFrames >= GetWindowSize())
-  {
-    // step through the sampleFrames based on our window size
-    // and perform the walsh
-    // place the output into the output buffer so that we can weight the results based on the dry/wet
-    for (int i = 0; i < kNumInputs; ++i)
-      for (int j = 0; j < sampleFrames; j += GetWindowSize())
-        walsh<T, double>(inputs[i] + j, output_buf_[i] + j);
+  Settings const& s        = e.settings;
+  Channel<S>&     ch       = c.channels[channel];
+  Lane<S>&        l        = e.lanes[channel];
+  int             win_size = s.win_size;
+  int             hop_size = s.hop_size;
 
-    // set the output using the dry/wet
-    for (int i = 0; i < kNumInputs; ++i)
-      for (int j = 0; j < sampleFrames; ++j)
-        outputs[i][j] = static_cast<T>(
-                        inputs[i][j]      * (1-params_[kDryWet]) + 
-                        output_buf_[i][j] *    params_[kDryWet]);
+  // take a copy of the transform so far, scaled like a forward transform,
+  // since the sliding transform needs its own to carry on with
+  S const* sliding = l.sliding.Coefficients();
+  S        scale   = static_cast<S>(1) / win_size;
+  for (int k = 0; k < win_size; ++k)
+    ch.coeffs[k] = sliding[k] * scale;
+
+  shape(c, e, channel);
+
+  // we only want the newest hop of the output, which is much cheaper than all of it
+  c.tables->plans.Get(s.win_power).InverseNewest(ch.coeffs, hop_size);
+
+  // which lines up with the hop we just got, so weight it against the dry input
+  // with the dry-wet control and queue it up to go out during the next hop
+  S const* first;
+  S const* second;
+  int      first_size;
+  ch.input_ring.Last(hop_size, &first, &first_size, &second);
+
+  S  dry   = static_cast<S>(s.dry);
+  S  wet   = static_cast<S>(s.wet);
+  S* queue = l.output_queue;
+  for (int j = 0; j < hop_size; ++j)
+  {
+    S in = j < first_size ? first[j] : second[j - first_size];
+    queue[j] = in * dry + ch.coeffs[j] * wet;
   }
+}
+
+template <typename TIn, typename S>
+void WalshingMachine::frame(Core<S>& c, Engine<S>& e, int channel, TIn const* first, int first_size, TIn const* second, int64_t deadline)
+{
+  Settings const& s  = e.settings;
+  Channel<S>&     ch = c.channels[channel];
+  Lane<S>&        l  = e.lanes[channel];
+
+  int win_size = s.win_size;
+  int hop_size = s.hop_size;
+  int overlap  = s.overlap;
+  S   dry      = static_cast<S>(s.dry);
+  S   wet      = static_cast<S>(s.wet);
+  S*  queue    = l.output_queue;
 
-  // 2. sampleFrames is < our window size
+  // perform the walsh on the window
+  S const* taper = overlap > 1 ? c.tables->windows.Get(s.win_power) : NULL;
+  walsh<TIn, S>(c, e, channel, first, first_size, second, taper, deadline);
+
+  if (overlap > 1)
+  {
+    // window the frame again on the way out and add it up with the ones it overlaps
+    S*  sum  = l.output_buf;
+    int mask = win_size - 1;
+    S   gain = algos::SqrtHannWindows<S>::Gain(overlap);
+    for (int k = 0; k < win_size; ++k)
+      sum[(l.overlap_pos + k) & mask] += ch.coeffs[k] * taper[k] * gain;
+
+    // the oldest hop has had every frame it's in added now, so it's done
+    // it lines up with the oldest hop of the window, which is our dry signal
+    for (int j = 0; j < hop_size; ++j)
+    {
+      int pos = (l.overlap_pos + j) & mask;
+      S   in  = static_cast<S>(j < first_size ? first[j] : second[j - first_size]);
+      queue[j] = in * dry + sum[pos] * wet;
+      sum[pos] = 0;
+    }
+  }
   else
   {
-    for (int i = 0; i < kNumInputs; ++i)
+    // now we cherry pick only the most "recent" data from the output,
+    // which lines up with the hop we just got, weight it against the dry input
+    // with the dry-wet control and queue it up to go out during the next hop
+    int start = win_size - hop_size;
+    for (int j = start; j < win_size; ++j)
     {
-      // shift our buffer back by sampleFrames
-      memmove(input_buf_[i], input_buf_[i] + sampleFrames, sampleFrames * sizeof *input_buf_[i]);
+      S in = static_cast<S>(j < first_size ? first[j] : second[j - first_size]);
+      queue[j - start] = in * dry + ch.coeffs[j] * wet;
+    }
+  }
+}
+
+// whether any output channel shares memory with any input channel
+template <typename T>
+static bool InPlace(T** inputs, int num_inputs, T** outputs, int num_outputs, int sampleFrames)
+{
+  for (int i = 0; i < num_outputs; ++i)
+    for (int j = 0; j < num_inputs; ++j)
+      if (outputs[i] < inputs[j] + sampleFrames && inputs[j] < outputs[i] + sampleFrames)
+        return true;
+  return false;
+}
+
+template <typename T, typename S>
+void WalshingMachine::RunFrame(void* job, int index)
+{
+  FrameJob<T, S> const& j       = *static_cast<FrameJob<T, S> const*>(job);
+  WalshingMachine&      m       = *j.self;
+  Core<S>&              c       = *j.core;
+  Engine<S>&            e       = *j.engine;
+  Settings const&       s       = e.settings;
+  int                   channel = j.channels[index];
+  Channel<S>&           ch      = c.channels[channel];
+
+  if (s.sliding)
+    m.slide_frame(c, e, channel);
+
+  // the whole window is in the host's input
+  else if (j.direct && j.done >= s.win_size)
+  {
+    T const* window = j.inputs[channel] + j.done - s.win_size;
+    m.frame<T, S>(c, e, channel, window, s.win_size, window, j.deadline);
+  }
 
-      // add the new input onto the end of our buffer
-      // can't do a memcpy because we don't know input type
-      for (int j = 0; j < sampleFrames; ++j)
-        input_buf_[i][GetWindowSize() - sampleFrames + j] = inputs[i][j];
+  // the window wraps around the end of the ring at most once, so the transform
+  // reads it as two pieces rather than us copying it out first
+  else
+  {
+    ch.input_ring.Write(j.inputs[channel] + j.written[channel], j.done - j.written[channel]);
+    j.written[channel] = j.done;
+
+    S const* first;
+    S const* second;
+    int      first_size;
+    ch.input_ring.Last(s.win_size, &first, &first_size, &second);
+    m.frame<S, S>(c, e, channel, first, first_size, second, j.deadline);
+  }
+
+  Lane<S>& l = e.lanes[channel];
+  l.overlap_pos = (l.overlap_pos + s.hop_size) & (s.win_size - 1);
+}
+
+template <typename T> 
+void WalshingMachine::process(T** inputs, T** outputs, VstInt32 sampleFrames)
+{
+  // the offline window only applies while the host is rendering offline, so when that
+  // changes, so might the settings. we can't work them out again here (or tell the host
+  // about the latency that comes with them), so the background thread does it for us,
+  // and the host's next call tells it
+  bool offline = getCurrentProcessLevel() == kVstProcessLevelOffline;
+  if (offline != offline_.load())
+  {
+    offline_.store(offline);
+    WakeBackground();
+  }
 
-      // perform the walsh into the output buffer
-      walsh<double, double>(input_buf_[i], output_buf_[i]);
+  // take the latest settings, which stay the same for the whole block
+  // offline nobody's listening, so rather than render on the wrong window, we wait for them
+  // to catch up with the offline window, and for there to be room for it
+  Settings const* settings = &settings_.Read();
+  while (offline && async_running_.load() && !Settled(*settings))
+  {
+    WakeBackground();
+    std::this_thread::yield();
+    settings = &settings_.Read();
+  }
 
-      // now we cherry pick only the most "recent" data from the output buffer
-      // and stick that into the output
-      // we also use the dry-wet control to weight the output
-      for (int j = 0; j < sampleFrames; ++j)
-        outputs[i][j] = inputs[i][j]                                                       * (1-params_[kDryWet]) + 
-                        static_cast<T>(output_buf_[i][GetWindowSize() - sampleFrames + j]) *    params_[kDryWet];
+  // work out who should be doing the frames. when that changes, whoever has the channels
+  // carries on while we fade them out, and once we're silent we ask for them to be handed
+  // over, and wait for the background thread to agree before we touch anything it might be
+  // using. in real time we can't wait, so we stay silent for the block or two that takes,
+  // but offline nobody is listening, so we do
+  unsigned owner    = settings->async ? (settings->epoch << 1) | 1 : 0;
+  bool     handover = owner != async_owner_;
+  if (handover && handover_gain_ == 0)
+  {
+    async_owner_   = owner;
+    handover_hold_ = settings->latency;
+    handover       = false;
+    RequestChannels(settings->async);
+  }
+  unsigned want = async_want_.load();
+  while (async_have_.load() != want)
+  {
+    if (!offline)
+    {
+      for (int i = 0; i < kNumOutputs; ++i)
+        for (int j = 0; j < sampleFrames; ++j)
+          outputs[i][j] = 0;
+      return;
     }
+    std::this_thread::yield();
   }
 
+  if (async_owner_ & 1)
+  {
+    async_process(inputs, outputs, sampleFrames, offline);
+    Fade(outputs, sampleFrames, handover);
+    return;
+  }
+
+  // the frames are worked out in whichever precision the host asked for
+  if (UseFloats())
+    sync_process(narrow_, *settings, inputs, outputs, sampleFrames);
+  else
+    sync_process(wide_, *settings, inputs, outputs, sampleFrames);
+  Fade(outputs, sampleFrames, handover);
+
   //// set output to a 440Hz wave
   //VstTimeInfo* time_info = getTimeInfo(NULL);
   //for (int i = 0; i < kNumOutputs; ++i)
@@ -130,3 +752,378 @@ void WalshingMachine::process(T** inputs, T** outputs, VstInt32 sampleFrames)
   return;
 }
 
+template <typename T>
+void WalshingMachine::Fade(T** outputs, int sampleFrames, bool out)
+{
+  if (!out && handover_gain_ == kCrossfade)
+    return;
+
+  for (int j = 0; j < sampleFrames; ++j)
+  {
+    if (out)
+      handover_gain_ = std::max(handover_gain_ - 1, 0);
+    else if (handover_hold_ > 0)
+      --handover_hold_;
+    else
+      handover_gain_ = std::min(handover_gain_ + 1, static_cast<int>(kCrossfade));
+
+    T gain = handover_gain_ / static_cast<T>(kCrossfade);
+    for (int i = 0; i < kNumOutputs; ++i)
+      outputs[i][j] *= gain;
+  }
+}
+
+template <typename T, typename S>
+void WalshingMachine::sync_process(Core<S>& c, Settings const& s, T** inputs, T** outputs, int sampleFrames)
+{
+  // the channels are about to go to the background thread, so we carry on as we were
+  // while we fade out
+  if (s.async)
+  {
+    Settings held = c.engines[active_].settings;
+    run(c, held, inputs, outputs, sampleFrames, 0);
+    return;
+  }
+
+  // the channels are ours, so if we've been asked to start again, we do it now
+  // (as long as there's room for it, which there always is unless the window has
+  // just grown, and even then only until the background thread has made some)
+  if (s.epoch != sync_epoch_)
+  {
+    if (!Fits(c, s))
+    {
+      for (int i = 0; i < kNumOutputs; ++i)
+        for (int j = 0; j < sampleFrames; ++j)
+          outputs[i][j] = 0;
+      return;
+    }
+    Restart(c, s);
+    sync_epoch_ = s.epoch;
+  }
+
+  run(c, s, inputs, outputs, sampleFrames, 0);
+}
+
+template <typename T, typename S>
+void WalshingMachine::run(Core<S>& c, Settings const& s, T** inputs, T** outputs, int sampleFrames, int slack)
+{
+  // follow the latest settings. anything that doesn't change the shape of the frames
+  // just carries on with the new values, but a new layout starts up the other engine
+  // and crossfades over to it. if the layout changes again before we're done,
+  // that waits for the switch we're in the middle of to finish, and if it's bigger
+  // than we have room for, it waits for the room (and then grows into it, see Grow)
+  if (!switching_)
+  {
+    if (s.layout == c.engines[active_].settings.layout)
+      c.engines[active_].settings = s;
+    else if (Fits(c, s))
+      StartSwitch(c, s);
+  }
+  else if (s.layout == c.engines[1 - active_].settings.layout)
+    c.engines[1 - active_].settings = s;
+
+  Engine<S>* live[2]  = { &c.engines[active_], &c.engines[1 - active_] };
+  int        num_live = switching_ ? 2 : 1;
+
+  // we only transform once every hop, whatever size blocks the host gives us
+  // (from a single sample up to huge offline blocks), and whatever is left over
+  // waits in the rings for the next call. the output comes from the queue of the
+  // last finished hop, which is why we're (at least) a hop late
+  //
+  // if the host gave us separate output buffers, a frame that lies entirely inside
+  // this block can be transformed straight from the host's input, and the rings
+  // only need to catch up when a frame reaches back into an earlier block (or at the end).
+  // if the output overwrites the input as we go, everything has to go through the rings
+  // the sliding transform always reads from the rings
+  bool sliding = false;
+  for (int e = 0; e < num_live; ++e)
+    sliding = sliding || live[e]->settings.sliding;
+  bool direct = !sliding && !InPlace(inputs, kNumInputs, outputs, kNumOutputs, sampleFrames);
+  int  written[kNumInputs] = {};
+
+  int done = 0;
+  while (done < sampleFrames)
+  {
+    // take as much as we can without going past the end of any channel's hop
+    // (when they're staggered, they each get to the end of theirs at a different time)
+    // or the end of a switch
+    int n = sampleFrames - done;
+    for (int e = 0; e < num_live; ++e)
+      for (int i = 0; i < kNumInputs; ++i)
+        n = std::min(n, live[e]->settings.hop_size - live[e]->lanes[i].hop_fill);
+    if (switching_)
+      n = std::min(n, warmup_ - switch_pos_ + static_cast<int>(kCrossfade));
+
+    for (int i = 0; i < kNumInputs; ++i)
+    {
+      if (!direct)
+      {
+        c.channels[i].input_ring.Write(inputs[i] + done, n);
+        written[i] = done + n;
+      }
+
+      for (int e = 0; e < num_live; ++e)
+        if (live[e]->settings.sliding)
+          for (int j = 0; j < n; ++j)
+            live[e]->lanes[i].sliding.Push(inputs[i][done + j]);
+
+      Lane<S>& from     = live[0]->lanes[i];
+      S const* from_out = from.output_queue + from.hop_fill;
+      if (!switching_)
+      {
+        for (int j = 0; j < n; ++j)
+          outputs[i][done + j] = static_cast<T>(from_out[j]);
+      }
+      else
+      {
+        // once the new engine is ready, fade it in over the old one
+        Lane<S>& to     = live[1]->lanes[i];
+        S const* to_out = to.output_queue + to.hop_fill;
+        for (int j = 0; j < n; ++j)
+        {
+          int pos  = switch_pos_ + j - warmup_;
+          S   gain = pos <= 0 ? 0 : pos >= kCrossfade ? 1 : pos / static_cast<S>(kCrossfade);
+          outputs[i][done + j] = static_cast<T>(from_out[j] * (1 - gain) + to_out[j] * gain);
+        }
+      }
+
+      for (int e = 0; e < num_live; ++e)
+        live[e]->lanes[i].hop_fill += n;
+    }
+
+    done += n;
+
+    // the channels with a hop's worth of new samples are due a frame
+    for (int e = 0; e < num_live; ++e)
+    {
+      int due[kNumInputs];
+      int num_due = 0;
+      for (int i = 0; i < kNumInputs; ++i)
+      {
+        Lane<S>& l = live[e]->lanes[i];
+        if (l.hop_fill == live[e]->settings.hop_size)
+        {
+          l.hop_fill     = 0;
+          due[num_due++] = i;
+        }
+      }
+
+      if (num_due > 0)
+        run_frames(c, *live[e], inputs, written, due, num_due, done, direct, Deadline(sampleFrames - done + slack));
+    }
+
+    // the new engine has faded all the way in, so it's the one we listen to now
+    if (switching_)
+    {
+      switch_pos_ += n;
+      if (switch_pos_ == warmup_ + kCrossfade)
+      {
+        active_    = 1 - active_;
+        switching_ = false;
+        num_live   = 1;
+        live[0]    = &c.engines[active_];
+      }
+    }
+  }
+
+  // keep what the next call needs
+  // (only the last window's worth actually goes in, however much is left)
+  for (int i = 0; i < kNumInputs; ++i)
+    c.channels[i].input_ring.Write(inputs[i] + written[i], sampleFrames - written[i]);
+  history_ = history_ > INT_MAX - sampleFrames ? INT_MAX : history_ + sampleFrames;
+}
+
+template <typename T, typename S>
+void WalshingMachine::run_frames(Core<S>& c, Engine<S>& e, T** inputs, int* written, int const* due, int num_due, int done, bool direct, int64_t deadline)
+{
+  // each channel's frames only touch that channel's state, so with the threads
+  // on, the workers take the other channels while we do the first.
+  // when the transforms are split, the workers are busy with those instead
+  FrameJob<T, S> job = { this, &c, &e, inputs, written, due, done, direct, deadline };
+  if (e.settings.threads && !e.settings.split && num_due > 1)
+    workers_->Run(client_, &RunFrame<T, S>, &job, num_due, deadline);
+  else
+    for (int i = 0; i < num_due; ++i)
+      RunFrame<T, S>(&job, i);
+}
+
+template <typename T>
+void WalshingMachine::async_process(T** inputs, T** outputs, int sampleFrames, bool offline)
+{
+  // the background thread has only just taken over, so there's nothing to make up yet
+  if (async_seen_ != async_want_.load())
+  {
+    async_seen_ = async_want_.load();
+    async_debt_ = 0;
+  }
+
+  int done = 0;
+  while (done < sampleFrames)
+  {
+    // hand over the input first, in case the output overwrites it
+    // if the background thread is so far behind that there's no room, the input is lost
+    // in real time, and offline we wait for it to make some
+    int n = std::min(sampleFrames - done, static_cast<int>(kAsyncBlock));
+    if (offline)
+    {
+      for (int i = 0; i < kNumInputs; ++i)
+        while (handoffs_[i].input.Space() < n)
+          std::this_thread::yield();
+    }
+    for (int i = 0; i < kNumInputs; ++i)
+      handoffs_[i].input.Write(inputs[i] + done, n);
+    WakeBackground();
+
+    // then take back as much output as there is
+    // every channel's hop goes in before the next one's, so we go by the one with the least
+    int ready = INT_MAX;
+    for (int i = 0; i < kNumOutputs; ++i)
+      ready = std::min(ready, handoffs_[i].output.Available());
+    while (offline && ready < n)
+    {
+      WakeBackground();
+      std::this_thread::yield();
+      ready = INT_MAX;
+      for (int i = 0; i < kNumOutputs; ++i)
+        ready = std::min(ready, handoffs_[i].output.Available());
+    }
+
+    // skip what we made up last time, then take what's left
+    int skip = std::min(async_debt_, ready);
+    int got  = std::min(ready - skip, n);
+    for (int i = 0; i < kNumOutputs; ++i)
+    {
+      handoffs_[i].output.Skip(skip);
+      handoffs_[i].output.Read(outputs[i] + done, got);
+      for (int j = got; j < n; ++j)
+        outputs[i][done + j] = 0;
+    }
+    async_debt_ += n - got - skip;
+
+    done += n;
+  }
+}
+
+void WalshingMachine::async_work()
+{
+  // our own copy of the settings, which only picks up new ones from the same epoch
+  // (anything else needs the channels starting again, which is the audio thread's call)
+  // we might have been started while the audio thread was processing, so the channels
+  // are its until it asks us for them
+  Settings s       = async_settings_.Read();
+  unsigned have    = async_have_.load();
+  unsigned changes = param_changes_.load();
+  bool     room    = false;
+  while (!async_stop_.load())
+  {
+    // anything new after this will change it, so we can't miss it while we look
+    uint64_t seen = async_posted_.load();
+
+    Settings const& latest = async_settings_.Read();
+    if (latest.epoch == s.epoch)
+      s = latest;
+
+    // take the channels over (from scratch), or give them back, when we're asked to
+    unsigned want = async_want_.load();
+    if (want != have)
+    {
+      if (want & 1)
+      {
+        s = latest;
+        room = UseFloats() ? async_restart(narrow_, s) : async_restart(wide_, s);
+      }
+      have = want;
+      async_have_.store(have);
+    }
+
+    // a parameter's changed, or the audio thread has seen the host start or stop rendering
+    // offline (which changes the window), so the settings need working out again
+    unsigned changed = param_changes_.load();
+    if (changed != changes || grow_to_.load() != GetWantedPower())
+    {
+      changes = changed;
+      Publish(false);
+    }
+
+    // make room for a bigger window, if we need to
+    if (Prepare())
+      continue;
+
+    if ((have & 1) && (UseFloats() ? async_step(narrow_, s, room) : async_step(wide_, s, room)))
+      continue;
+
+    // nothing to do, so sleep until there is. the audio thread wakes us every block while
+    // we're doing the frames, and each frame has a whole window to be done in, so there's
+    // no need to spin for the next one
+    async_wake_.Arm();
+    if (async_posted_.load() == seen && !async_stop_.load())
+      async_wake_.Sleep();
+    else
+      async_wake_.Disarm();
+  }
+}
+
+template <typename S>
+bool WalshingMachine::async_restart(Core<S>& c, Settings const& s)
+{
+  // the audio thread isn't touching the hand-offs until we say so, so we can empty them
+  // (or make them, if this is the first time). we're not the audio thread, so if the
+  // buffers aren't big enough yet, we can just make them bigger. if there isn't the memory
+  // for that, we stay silent (as the audio thread does when it hasn't the room, see
+  // sync_process) until we're next asked to start again
+  bool room = Fits(c, s) || Allocate(s.win_power, s.sliding ? s.win_power : 0);
+  if (room)
+    Restart(c, s);
+
+  for (int i = 0; i < kNumInputs; ++i)
+  {
+    Handoff& h = handoffs_[i];
+    if (h.in.size() == 0)
+    {
+      h.input.Resize(kAsyncPower);
+      h.output.Resize(kAsyncPower);
+      h.in.Resize(kAsyncBlock);
+      h.out.Resize(kAsyncBlock);
+      footprint_ += (2 * (static_cast<size_t>(1) << kAsyncPower) + 2 * kAsyncBlock) * sizeof(double);
+    }
+
+    handoffs_[i].input.Clear();
+    handoffs_[i].output.Clear();
+    handoffs_[i].output.WriteZeros(s.win_size);
+  }
+  return room;
+}
+
+template <typename S>
+bool WalshingMachine::async_step(Core<S>& c, Settings const& s, bool room)
+{
+  // take as much input as there is, as long as there's room for its output
+  int n = kAsyncBlock;
+  for (int i = 0; i < kNumInputs; ++i)
+    n = std::min(n, std::min(handoffs_[i].input.Available(), handoffs_[i].output.Space()));
+  if (n == 0)
+    return false;
+
+  double* inputs[kNumInputs];
+  double* outputs[kNumOutputs];
+  for (int i = 0; i < kNumInputs; ++i)
+  {
+    handoffs_[i].input.Read(handoffs_[i].in.data(), n);
+    inputs[i]  = handoffs_[i].in.data();
+    outputs[i] = handoffs_[i].out.data();
+  }
+
+  // this is just like a block on the audio thread, except that each frame has a whole
+  // window to get back to it. there's no callback to spread the work over here, so
+  // there's no staggering either
+  if (room)
+    run(c, s, inputs, outputs, n, s.win_size);
+  else
+    for (int i = 0; i < kNumOutputs; ++i)
+      memset(outputs[i], 0, n * sizeof(double));
+
+  for (int i = 0; i < kNumOutputs; ++i)
+    handoffs_[i].output.Write(handoffs_[i].out.data(), n);
+
+  return true;
+}
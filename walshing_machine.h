@@ -1,13 +1,38 @@
 #include <algorithm>
+#include <atomic>
 #include <audioeffectx.h>
+#include <climits>
+#include <mutex>
+#include <thread>
 #include <vector>
+#ifndef NOMINMAX
+  #define NOMINMAX // so windows doesn't turn std::min and std::max into macros
+#endif
 #include <Windows.h> // for Beep
 
+#include "algos/fwht.h"
+#include "algos/fwht_sliding.h"
+#include "algos/gate.h"
+#include "algos/ring.h"
+#include "algos/select.h"
+#include "algos/snapshot.h"
+#include "algos/spsc.h"
+#include "algos/wake.h"
+#include "algos/window.h"
+#include "algos/worker_pool.h"
+
 class WalshingMachine : public AudioEffectX
 {
 public:
   WalshingMachine(audioMasterCallback audioMaster, VstInt32 numPrograms, VstInt32 numParams) 
-    : AudioEffectX(audioMaster, numPrograms, numParams) 
+    : AudioEffectX(audioMaster, numPrograms, numParams), tables_(NULL), precision_(kVstProcessPrecision64),
+      active_(0), switching_(false), switch_pos_(0), warmup_(0), history_(INT_MAX),
+      arena_power_(-1), arena_slide_(0), spare_power_(-1), spare_slide_(0), spare_ready_(false), capacity_(0), slide_capacity_(0),
+      grow_to_(0), slide_to_(0), too_big_(kMaxOfflinePower + 1), footprint_(0),
+      offline_(false), instance_slot_(instance_count_++ % kStaggerSlots), workers_(NULL), client_(-1),
+      published_(), epoch_(0), layout_(0), latency_(0), reported_latency_(0), sync_epoch_(0), async_owner_(0), async_requests_(0),
+      async_want_(0), async_have_(0), async_stop_(false), async_open_(false), async_running_(false),
+      async_posted_(0), async_seen_(0), async_debt_(0), handover_gain_(kCrossfade), handover_hold_(0)
   {
 	  setNumInputs(kNumInputs);   // stereo in
 	  setNumOutputs(kNumOutputs); // stereo out
@@ -16,8 +41,38 @@ public:
     canDoubleReplacing();       // supports double replacing mode
 
     // start with everything at 0
-    memset(params_, 0, sizeof params_);
+    for (int i = 0; i < kNumParams; ++i)
+      params_[i].store(0);
+    param_changes_.store(0);
+
+    // find out how much room every window size needs in each precision, with and without
+    // the sliding transform (nothing's using the buffers yet, so a dry run through them is fine),
+    // then make room for the one we start with, in doubles
+    JoinTables();
+    for (int precision = kVstProcessPrecision32; precision <= kVstProcessPrecision64; ++precision)
+    {
+      precision_.store(precision);
+      for (int power = 0; power <= kMaxOfflinePower; ++power)
+      {
+        for (int sliding = 0; sliding <= std::min(power, static_cast<int>(kMaxSlidingPower)); ++sliding)
+        {
+          algos::Arena dry;
+          Place(dry, power, sliding);
+          arena_bytes_[precision][power][sliding] = dry.Used();
+        }
+      }
+    }
+    precision_.store(kVstProcessPrecision64);
+    Allocate(GetWantedPower(), GetSlidingPower());
+    Publish(true);
+
+    // the host reads this once we're made, so there's no need to tell it
+    reported_latency_.store(latency_.load());
+    setInitialDelay(latency_.load());
   }
+
+  ~WalshingMachine()
+  { LeaveTables(); }
    
   enum Params
   {
@@ -27,32 +82,69 @@ public:
     kLPFreq,
     kNormliz,
     kDryWet,
+    kLossMode,
+    kHyster,
+    kHopSize,
+    kOverlap,
+    kThreads,
+    kAsync,
+    kStagger,
+    kOffWin,
     kNumParams
   };
 
+  // what the stagger parameter means
+  enum StaggerModes
+  {
+    kStaggerOff,      // every channel does its frame on the same sample
+    kStaggerChannels, // the channels take turns through the hop
+    kStaggerAll,      // so do the instances, as far as they can
+    kNumStaggerModes
+  };
+
+  // what the loss parameter means
+  enum LossModes
+  {
+    kLossCount,   // remove that fraction of the coefficients, smallest first
+    kLossGate,    // remove everything below an absolute magnitude
+    kLossRmsGate, // remove everything below a multiple of the frame's rms
+    kLossEnergy,  // keep only the biggest coefficients that hold some of the frame's energy
+    kNumLossModes
+  };
+
 	// Returns tail size; 0 is default (return 1 for 'no tail'), used in offline processing too
   // We return the maximum window size because we don't want our buffer filled with
   // junk if we adjust our position within the track. We'll see if this makes a difference...
+  // the offline window can be a lot bigger than that, when it's on
   virtual VstInt32 getGetTailSize() 
-  { return 1<<kMaxWinPower; }
+  { return 1 << (GetOfflinePower() > kMaxWinPower ? GetOfflinePower() : kMaxWinPower); }
 
 	// Return the value of the parameter with index
   virtual float getParameter(VstInt32 index) 
   { return params_[index]; }
 
  	// Called when a parameter changed
+  // this can come from any thread, the audio thread included (hosts automate from there),
+  // so all it does is store the value and wake the background thread, which never takes a
+  // lock or allocates. the background thread works the new settings out and publishes them
+  // for the audio thread to pick up at the start of its next block, and makes room for the
+  // window if it's got bigger than we have room for.
+  // changing the window size (or hop, overlap or stagger) doesn't start again from silence,
+  // the audio thread crossfades over to the new size, but it can change our latency,
+  // which the host hears about the next time it calls us on one of its own threads
+  // (see ReportLatency)
   virtual void setParameter(VstInt32 index, float value) 
   {
-    params_[index] = value; 
-  
-    // if we're changing the window size, reset the buffer
-    switch (index)
-    {
-    case kWinSize: 
-      for (int i = 0; i < kNumInputs; ++i)
-        memset(input_buf_[i], 0, sizeof input_buf_[i]); 
-      break;
-    }
+    params_[index].store(value);
+    param_changes_.fetch_add(1);
+    WakeBackground();
+  }
+
+  // the filter cutoffs depend on the sample rate
+  virtual void setSampleRate(float sampleRate)
+  {
+    AudioEffectX::setSampleRate(sampleRate);
+    Publish(false);
   }
 
   // Stuff label with the units in which parameter index is displayed (i.e. "sec", "dB", "type", etc...). Limited to #kVstMaxParamStrLen. 	
@@ -61,11 +153,27 @@ public:
     switch (index)
     {
     case kWinSize: strcpy_s(label, kVstMaxParamStrLen, ""); break;
-    case kLoss:    strcpy_s(label, kVstMaxParamStrLen, "%"); break;
+    case kLoss:
+      switch (GetLossMode())
+      {
+      case kLossCount:   strcpy_s(label, kVstMaxParamStrLen, "%");    break;
+      case kLossGate:    strcpy_s(label, kVstMaxParamStrLen, "dB");   break;
+      case kLossRmsGate: strcpy_s(label, kVstMaxParamStrLen, "xRMS"); break;
+      case kLossEnergy:  strcpy_s(label, kVstMaxParamStrLen, "%kept"); break;
+      }
+      break;
     case kHPFreq:  strcpy_s(label, kVstMaxParamStrLen, "Hz"); break;
     case kLPFreq:  strcpy_s(label, kVstMaxParamStrLen, "Hz"); break;
     case kNormliz: strcpy_s(label, kVstMaxParamStrLen, "%"); break;
     case kDryWet:  strcpy_s(label, kVstMaxParamStrLen, "%"); break;
+    case kLossMode: strcpy_s(label, kVstMaxParamStrLen, ""); break;
+    case kHyster:  strcpy_s(label, kVstMaxParamStrLen, "dB"); break;
+    case kHopSize: strcpy_s(label, kVstMaxParamStrLen, "smps"); break;
+    case kOverlap: strcpy_s(label, kVstMaxParamStrLen, ""); break;
+    case kThreads: strcpy_s(label, kVstMaxParamStrLen, ""); break;
+    case kAsync:   strcpy_s(label, kVstMaxParamStrLen, ""); break;
+    case kStagger: strcpy_s(label, kVstMaxParamStrLen, ""); break;
+    case kOffWin:  strcpy_s(label, kVstMaxParamStrLen, ""); break;
     }
   }	
 
@@ -79,11 +187,55 @@ public:
     switch (index)
     {
     case kWinSize: int2string(GetWindowSize(), text, kVstMaxParamStrLen); break;
-    case kLoss:    float2string(params_[kLoss]    * 100, text, kVstMaxParamStrLen); break;
+    case kLoss:
+      switch (GetLossMode())
+      {
+      case kLossCount:   float2string(params_[kLoss] * 100, text, kVstMaxParamStrLen); break;
+      case kLossGate:    float2string(static_cast<float>(GateThresholdDb()), text, kVstMaxParamStrLen); break;
+      case kLossRmsGate: float2string(static_cast<float>(GateRmsRatio()), text, kVstMaxParamStrLen); break;
+      case kLossEnergy:  float2string(static_cast<float>(EnergyKept() * 100), text, kVstMaxParamStrLen); break;
+      }
+      break;
     case kHPFreq:  int2string(static_cast<int>(FilterToHz(params_[kHPFreq])), text, kVstMaxParamStrLen); break;
     case kLPFreq:  int2string(static_cast<int>(FilterToHz(params_[kLPFreq])), text, kVstMaxParamStrLen); break;
     case kNormliz: float2string(params_[kNormliz] * 100, text, kVstMaxParamStrLen); break;
     case kDryWet:  float2string(params_[kDryWet]  * 100, text, kVstMaxParamStrLen); break;
+    case kLossMode:
+      switch (GetLossMode())
+      {
+      case kLossCount:   strcpy_s(text, kVstMaxParamStrLen, "Count");   break;
+      case kLossGate:    strcpy_s(text, kVstMaxParamStrLen, "Gate");    break;
+      case kLossRmsGate: strcpy_s(text, kVstMaxParamStrLen, "RMSGate"); break;
+      case kLossEnergy:  strcpy_s(text, kVstMaxParamStrLen, "Energy");  break;
+      }
+      break;
+    case kHyster:  float2string(static_cast<float>(HysteresisDb()), text, kVstMaxParamStrLen); break;
+    case kHopSize: int2string(GetHopSize(), text, kVstMaxParamStrLen); break;
+    case kOverlap:
+      switch (GetOverlap())
+      {
+      case 1:  strcpy_s(text, kVstMaxParamStrLen, "Off"); break;
+      case 2:  strcpy_s(text, kVstMaxParamStrLen, "2x");  break;
+      case 4:  strcpy_s(text, kVstMaxParamStrLen, "4x");  break;
+      default: strcpy_s(text, kVstMaxParamStrLen, "8x");  break;
+      }
+      break;
+    case kThreads: strcpy_s(text, kVstMaxParamStrLen, UseThreads() ? "On" : "Off"); break;
+    case kAsync:   strcpy_s(text, kVstMaxParamStrLen, UseAsync()   ? "On" : "Off"); break;
+    case kStagger:
+      switch (GetStagger())
+      {
+      case kStaggerOff:      strcpy_s(text, kVstMaxParamStrLen, "Off");   break;
+      case kStaggerChannels: strcpy_s(text, kVstMaxParamStrLen, "Chans"); break;
+      case kStaggerAll:      strcpy_s(text, kVstMaxParamStrLen, "All");   break;
+      }
+      break;
+    case kOffWin:
+      if (GetOfflinePower() > 0)
+        int2string(1 << GetOfflinePower(), text, kVstMaxParamStrLen);
+      else
+        strcpy_s(text, kVstMaxParamStrLen, "Off");
+      break;
     }
   }
 
@@ -98,6 +250,14 @@ public:
     case kLPFreq:  strcpy_s(text, kVstMaxParamStrLen, "LPFreq");  break;
     case kNormliz: strcpy_s(text, kVstMaxParamStrLen, "Normliz"); break;
     case kDryWet:  strcpy_s(text, kVstMaxParamStrLen, "Dry/Wet"); break;
+    case kLossMode: strcpy_s(text, kVstMaxParamStrLen, "LossMod"); break;
+    case kHyster:  strcpy_s(text, kVstMaxParamStrLen, "Hyster");  break;
+    case kHopSize: strcpy_s(text, kVstMaxParamStrLen, "HopSize"); break;
+    case kOverlap: strcpy_s(text, kVstMaxParamStrLen, "Overlap"); break;
+    case kThreads: strcpy_s(text, kVstMaxParamStrLen, "Threads"); break;
+    case kAsync:   strcpy_s(text, kVstMaxParamStrLen, "Async");   break;
+    case kStagger: strcpy_s(text, kVstMaxParamStrLen, "Stagger"); break;
+    case kOffWin:  strcpy_s(text, kVstMaxParamStrLen, "OffWin");  break;
     }
   }	
 
@@ -107,29 +267,121 @@ public:
   // Process 64 bit (double precision) floats (always in a resume state)
   virtual void processDoubleReplacing(double** inputs, double** outputs, VstInt32 sampleFrames);
 
-  //// Called when plug-in is initialized
-  // virtual void open()
-  // { Beep(4000, 100); }		
+  // Called when plug-in is initialized
+  // the workers are shared by every instance, and the first one to open starts them,
+  // so the audio thread never has to create them.
+  // from now on we can have a background thread too, which is started when we're resumed
+  // (see StartBackground)
+  virtual void open()
+  {
+    JoinWorkers();
 
-  //// Called when plug-in will be released
-  // virtual void close() 
-  // { Beep(3000, 100); }	
+    async_owner_ = 0;
+    async_want_.store(0);
+    async_have_.store(0);
+    async_stop_.store(false);
+    async_open_ = true;
+    Publish(true);
+    ReportLatency();
+  }
+
+  // Called when plug-in will be released
+  virtual void close() 
+  {
+    async_open_ = false;
+    if (async_running_.load())
+    {
+      async_stop_.store(true);
+      WakeBackground();
+      async_thread_.join();
+      async_running_.store(false);
+    }
+    LeaveWorkers();
+    Publish(true);
+  }
 
   //// Called when plug-in is switched to off
   // virtual void suspend()
   // { Beep(2000, 100); }	
 
-  //// Called when plug-in is switched to on
-  //virtual void resume()
-  //{ Beep(1000, 100); }
+  // Called when plug-in is switched to on
+  // start again from silence, with the buffers sized for the window we're starting with.
+  // nothing's processing, so this is the place to allocate, once we've got the
+  // channels back from the background thread, and to start the background thread if it
+  // isn't running yet, since from now on the parameters can change while we're processing.
+  // there might be more memory to be had than last time, so we try any size again
+  virtual void resume()
+  {
+    TakeChannels();
+    too_big_ = kMaxOfflinePower + 1;
+    Allocate(GetWantedPower(), GetSlidingPower());
+    StartBackground();
+    ResetHops();
+    GiveChannels();
+    AudioEffectX::resume();
+  }
+
+  // the host tells us (while we're suspended) which of the process calls it's going to use,
+  // and we work the frames out in the same precision (see Core). that lays everything out
+  // again, so it's done once we have the channels back, and we start again from silence
+  virtual bool setProcessPrecision(VstInt32 precision)
+  {
+    if (precision != kVstProcessPrecision32 && precision != kVstProcessPrecision64)
+      return false;
+    if (precision == precision_.load())
+      return true;
+
+    TakeChannels();
+    precision_.store(precision);
+    if (!Allocate(GetWantedPower(), GetSlidingPower()))
+      Allocate(kMinWinPower, 0);
+    Publish(true);
+    ReportLatency();
+    GiveChannels();
+    return true;
+  }
 
-  //// Called one time before the start of process call. This indicates that the process call will be interrupted (due to Host reconfiguration or bypass state when the plug-in doesn't support softBypass)
-  //virtual VstInt32 startProcess() 
-  //{ Beep(500, 100);  return 0; }		
+  // hosts can ask how much memory an instance has to itself (not counting the tables
+  // every instance shares) with vendorSpecific(kFootprintOpcode), which returns it in bytes
+  static const VstInt32 kFootprintOpcode = 'WMfp';
+
+  virtual VstIntPtr vendorSpecific(VstInt32 lArg, VstIntPtr lArg2, void* ptrArg, float floatArg)
+  {
+    if (lArg == kFootprintOpcode)
+      return static_cast<VstIntPtr>(Footprint());
+    return AudioEffectX::vendorSpecific(lArg, lArg2, ptrArg, floatArg);
+  }
 
-  //// Called after the stop of process call
-  // virtual VstInt32 stopProcess() 
-  // { Beep(200, 100); return 0; }
+  // the instance itself, plus the buffers it's allocated
+  size_t Footprint() const
+  { return sizeof(*this) + footprint_.load(); }
+
+  // Called one time before the start of process call. This indicates that the process call will be interrupted (due to Host reconfiguration or bypass state when the plug-in doesn't support softBypass)
+  // this is usually the host getting ready to render, which is when it knows whether it's
+  // rendering offline, so if it'll tell us we catch up with it. nothing's processing, so if
+  // that means a bigger window, this is the place to make room for it (and start again
+  // from silence with it), so the host knows our latency before the render starts
+  virtual VstInt32 startProcess() 
+  {
+    offline_.store(getCurrentProcessLevel() == kVstProcessLevelOffline);
+    int wanted = GetWantedPower();
+    if (wanted > capacity_.load() && wanted < too_big_.load())
+    {
+      TakeChannels();
+      Allocate(wanted, GetSlidingPower());
+      ResetHops();
+      GiveChannels();
+    }
+    CatchUp();
+    return 0;
+  }
+
+  // Called after the stop of process call
+  virtual VstInt32 stopProcess() 
+  {
+    CatchUp();
+    return 0;
+  }
 
   enum Programs
   {
@@ -142,7 +394,11 @@ private:
   static const int kNumOutputs = 2;
 
   // our actual parameter values
-  float params_[kNumParams];
+  // these are only for setParameter and the displays, the audio thread works from the settings.
+  // param_changes_ is bumped every time one's set, which is how the background thread
+  // knows to work the settings out again
+  std::atomic<float>    params_[kNumParams];
+  std::atomic<unsigned> param_changes_;
 
   // with these values, the filter will run from 2Hz-20,000Hz
   static const int kMinFiltFreq  = 2;
@@ -156,49 +412,775 @@ private:
   static const int kMinWinPower = 1;
   static const int kMaxWinPower = 14;
 
+  // offline, the offline window parameter can take the window on up to 2^22 = 4194304
+  // (about 95 seconds at 44.1kHz), for mastering jobs where nobody minds waiting for it.
+  // these are only ever used offline, where there's no deadline, so they're allowed to do
+  // things the real time ones can't, like wait for the background thread to make room
+  // for them. their buffers come to about 82 bytes per sample of the window in doubles
+  // (they never crossfade, so only the first engine has room for them), so about 330MB at 2^22
+  static const int kMaxOfflinePower = 22;
+
+  // the hop size knob runs from a whole window down to a single sample
+  static const int kMaxHopDiv = kMaxWinPower;
+
+  // the biggest window we'll use the sliding transform for
+  // it remembers about N^2/3 coefficients per lane, which is 2.8MB at 2^10 in doubles,
+  // and there are four lanes (two channels for each of the two engines), so the arena
+  // only has room for it while the hop uses it
+  static const int kMaxSlidingPower = 10;
+
+  // the smallest window we'll hand off to the background thread
+  // below this the transform is cheap enough that the extra window of latency isn't worth it
+  static const int kMinAsyncPower = 12;
+
+  // the smallest window whose transforms are each shared out over the workers, rather than
+  // the workers taking a channel each. that's the offline windows, which are too big for
+  // any one core's cache, and there are only two channels to go round a lot more cores
+  static const int kMinSplitPower = kMaxWinPower + 1;
+
+  // the overlap knob runs from off (plain rectangular windows) to 8x, in powers of 2
+  static const int kMaxOverlapPower = 3;
+
+  // how many different places through a hop the instances can do their frames in
+  // each instance takes the next one when it's created, so up to this many instances
+  // never do their frames at the same time as each other
+  static const int kStaggerSlots = 8;
+
+  // how long the crossfade is when the window size (or the hop, overlap or stagger) changes
+  static const int kCrossfade = 1024;
+
   // a divider to make the amount knob act non-linearly
   // that way, we don't get all of the 'action' in the last 5%
   // if the value is 16, we'll take the 16th root of the actual value.
   static const int kAmountRoot = 16;
 
-  // get the window size power based on the window size parameter
-  int GetWindowPower() { return static_cast<int>(params_[kWinSize] * (kMaxWinPower - kMinWinPower) + kMinWinPower + 0.5); }
+  // in gate mode the loss knob runs the threshold from -120dB to 0dB
+  static const int kGateRangeDb = 120;
+
+  // in rms gate mode the loss knob runs the threshold from 0 to 4x the rms of the frame
+  static const int kMaxRmsRatio = 4;
+
+  // in energy mode the loss knob runs the energy we throw away from -60dB to all of it
+  static const int kEnergyRangeDb = 60;
+
+  // the hysteresis knob runs the band around the threshold from 0dB (off) to 12dB either side
+  static const int kMaxHysteresisDb = 12;
+
+  // get the loss mode based on the loss mode parameter
+  int GetLossMode() { return static_cast<int>(params_[kLossMode] * (kNumLossModes - 1) + 0.5); }
+
+  // the gate thresholds based on the loss parameter
+  double GateThresholdDb() { return (params_[kLoss] - 1) * kGateRangeDb; }
+  double GateThreshold()   { return pow(10, GateThresholdDb() / 20); }
+  double GateRmsRatio()    { return params_[kLoss] * kMaxRmsRatio; }
+
+  // the fraction of the energy we keep in energy mode based on the loss parameter
+  double EnergyKept()      { return 1 - pow(10, (params_[kLoss] - 1) * kEnergyRangeDb / 10); }
+
+  // the width of the hysteresis band either side of the threshold based on the hysteresis parameter
+  // 0dB turns it off, and the selection removes exactly what the loss knob asks for
+  double HysteresisDb()    { return params_[kHyster] * kMaxHysteresisDb; }
+  double Hysteresis()      { return pow(10, HysteresisDb() / 20); }
+
+  // get the window size power based on the window size parameter,
+  // or when we're rendering offline, the offline window parameter if it's on
+  int GetWantedPower()
+  {
+    if (offline_.load() && GetOfflinePower() > 0)
+      return GetOfflinePower();
+    return static_cast<int>(params_[kWinSize] * (kMaxWinPower - kMinWinPower) + kMinWinPower + 0.5);
+  }
+
+  // get the offline window size power based on the offline window parameter
+  // it runs on from the biggest real time window, and 0 means off
+  int GetOfflinePower()
+  {
+    int step = static_cast<int>(params_[kOffWin] * (kMaxOfflinePower - kMaxWinPower) + 0.5);
+    return step > 0 ? kMaxWinPower + step : 0;
+  }
+
+  // the window size power we're actually using, which waits for the buffers to be
+  // big enough for it if the window has just got bigger
+  int GetWindowPower() { return std::min(GetWantedPower(), capacity_.load()); }
 
   // get the window size based on the window size parameter
   int GetWindowSize()  { return 1<<GetWindowPower(); };
 
+  // get the overlap factor based on the overlap parameter, 1 means no overlap
+  // tiny windows can't overlap more than they have samples
+  int GetOverlap()     { return GetOverlap(GetWindowSize()); }
+  int GetOverlap(int win_size)
+  { return std::min(1 << static_cast<int>(params_[kOverlap] * kMaxOverlapPower + 0.5), win_size); }
+
+  // get the hop size (how many new samples between transforms) based on the window size and hop size parameters
+  // when we overlap, the overlap decides it instead
+  // it's never more than the window, or less than one sample
+  int GetHopSize()     { return GetHopSize(GetWindowSize()); }
+  int GetHopSize(int win_size)
+  {
+    if (GetOverlap(win_size) > 1)
+      return win_size / GetOverlap(win_size);
+    return std::max(win_size >> static_cast<int>(params_[kHopSize] * kMaxHopDiv + 0.5), 1);
+  }
+
+  // whether to slide the transform along a sample at a time rather than doing a whole
+  // one every hop, for a window of 2^power. sliding costs about 2N per sample, so 2N * hop
+  // per frame, against N log N for a whole transform, so it only wins for tiny hops (which
+  // is what you want with the tiny blocks of modular hosts). it needs the whole window for
+  // every sample, so it can't overlap, and it only fits small windows
+  bool SlidingWins(int power)
+  { return power <= kMaxSlidingPower && GetOverlap(1 << power) == 1 && 2 * GetHopSize(1 << power) < power; }
+
+  // the window we want room for the sliding transform's history for, 0 if it isn't used
+  int GetSlidingPower() { return SlidingWins(GetWantedPower()) ? GetWantedPower() : 0; }
+
+  // whether we're sliding. the buffers only have room for it while the hop asks for it,
+  // so when it starts to, we do without until the background thread has made some
+  bool UseSliding()
+  { return SlidingWins(GetWindowPower()) && GetWindowPower() <= slide_capacity_.load(); }
+
+  // whether to work on the channels at the same time, based on the threads parameter
+  // (and whether we managed to start any workers)
+  bool UseThreads() { return params_[kThreads] >= 0.5 && client_ >= 0 && workers_->Threads() > 0; }
+
+  // whether to share each transform out over the workers, rather than the channels
+  bool UseSplit() { return UseThreads() && GetWindowPower() >= kMinSplitPower; }
+
+  // when work handed to the workers now has to be done by, if it's frames samples' worth
+  // of time away. the workers take whoever's deadline is soonest first
+  int64_t Deadline(int frames)
+  { return algos::WorkerPool::Now() + static_cast<int64_t>(frames * 1e6 / getSampleRate()); }
+
+  // take (and if we're the first, start) or give back (and if we're the last, stop)
+  // the worker pool every instance in the process shares
+  void JoinWorkers();
+  void LeaveWorkers();
+
+  // whether the frames happen on the background thread, based on the async parameter
+  // (and whether the window is big enough, and the thread has been started).
+  // the offline windows never do (even while we're still making room for them): the hand-offs
+  // only fit the real time ones, and offline there's no deadline for it to help with anyway
+  bool UseAsync()
+  {
+    return params_[kAsync] >= 0.5 && GetWindowPower() >= kMinAsyncPower && GetWantedPower() <= kMaxWinPower &&
+           async_running_.load();
+  }
+
+  // get the stagger mode based on the stagger parameter
+  int GetStagger() { return static_cast<int>(params_[kStagger] * (kNumStaggerModes - 1) + 0.5); }
+
+  // where through the hop a channel does its frame, so the channels (and instances)
+  // don't all pile their transforms into the same callback.
+  // they're spread evenly over kNumInputs * kStaggerSlots places in the hop
+  int GetPhase(int channel)
+  {
+    // the background thread has no callbacks to spread them over
+    if (UseAsync())
+      return 0;
+
+    int slot = 0;
+    switch (GetStagger())
+    {
+    case kStaggerOff:      return 0;
+    case kStaggerChannels: slot = channel * kStaggerSlots;                  break;
+    case kStaggerAll:      slot = channel * kStaggerSlots + instance_slot_; break;
+    }
+    return static_cast<int>(static_cast<int64_t>(slot) * GetHopSize() / (kNumInputs * kStaggerSlots));
+  }
+
+  // how late our output is
+  // without overlap we're a hop late. with it, a sample isn't finished until the
+  // last frame it's in has been added up, which is a whole window later.
+  // staggering doesn't add anything: each channel is still exactly that late, it just
+  // finishes its hops at a different point than the others.
+  // the background thread gets a whole window to finish each frame in, so that's another window
+  int GetLatency()
+  { return (GetOverlap() > 1 ? GetWindowSize() : GetHopSize()) + (UseAsync() ? GetWindowSize() : 0); }
+
+  // everything the audio thread (and the background thread) needs from the parameters,
+  // worked out once whenever a parameter changes rather than every frame
+  struct Settings
+  {
+    // bumped whenever the hops have to start again from scratch
+    unsigned epoch;
+
+    // bumped whenever the shape of the frames (the window, hop, overlap or stagger) changes,
+    // which the audio thread crossfades over rather than starting again
+    unsigned layout;
+
+    int  win_power;
+    int  wanted_power; // what the window would be, if there was room for it
+    int  win_size;
+    int  hop_size;
+    int  overlap;
+    int  phase[kNumInputs];
+    bool sliding;
+    bool threads;
+    bool split;
+    bool async;
+    int  latency;
+
+    // the filter, as the lowest and highest sequency index we keep
+    int hp_cut_idx;
+    int lp_cut_idx;
+
+    // the loss, in whatever form its mode needs
+    int    loss_mode;
+    int    remove;         // count mode
+    double gate_threshold; // gate mode
+    double rms_ratio;      // rms gate mode
+    double energy_kept;    // energy mode
+    double hysteresis;
+
+    double normalize;
+    double dry;
+    double wet;
+  };
+
+  // the frames of every channel for one set of settings, and everything the frames
+  // work on, worked out in S (float or double), see below
+  template <typename S> struct Engine;
+  template <typename S> struct Core;
+
+  // work out the settings from the parameters and hand them to the threads that use them.
+  // if restart is set they'll start again from scratch (as they also do going in or out
+  // of the background thread).
+  // this is the only place the parameters are turned into settings, and it can be called
+  // from any thread but the audio thread
+  void Publish(bool restart);
+
+  // tell the host our latency, if it's changed since we last did.
+  // the host only expects to hear from us on its own threads, and not from the audio thread,
+  // so the background thread (and setParameter, which can be on the audio thread) leaves it
+  // to the next time the host calls us on one of those
+  void ReportLatency()
+  {
+    int latency = latency_.load();
+    if (reported_latency_.exchange(latency) == latency)
+      return;
+    setInitialDelay(latency);
+    ioChanged();
+  }
+
+  // whatever the audio thread (or setParameter) has left for the host's own threads: if it's
+  // seen the host start or stop rendering offline, the settings might need working out again
+  // (which the background thread will do, if it gets there first), and our latency might have changed
+  void CatchUp()
+  {
+    if (grow_to_.load() != GetWantedPower())
+      Publish(false);
+    ReportLatency();
+  }
+
+  // whether the settings are the ones we'll end up with for the window we want: it's either
+  // the one we want, or the biggest we could get. offline, the audio thread waits for them
+  bool Settled(Settings const& s)
+  { return s.wanted_power == GetWantedPower() && (s.win_power == s.wanted_power || s.wanted_power >= too_big_.load()); }
+
+  // start the hops again from scratch, e.g. when the host resumes us
+  // that can change our latency, so we let the host know.
+  // the channels belong to whichever thread does the frames, so this only asks for
+  // them to be cleared, and that thread does it before its next frame
+  void ResetHops()
+  {
+    Publish(true);
+    ReportLatency();
+  }
+
+  // actually start again from silence, on the thread that owns the channels
+  template <typename S>
+  void Restart(Core<S>& c, Settings const& s)
+  {
+    for (int i = 0; i < kNumInputs; ++i)
+      c.channels[i].input_ring.Clear();
+    history_ = INT_MAX;
+
+    active_    = 0;
+    switching_ = false;
+    c.engines[active_].settings = s;
+    ResetEngine(c.engines[active_]);
+  }
+
+  // start the other engine on a new layout, from the input we already have, while the one
+  // we're listening to carries on. once the new one has warmed up (it's had every frame
+  // its output needs) we crossfade over to it. if the rings have only just grown, the
+  // new window reaches back past the input they kept, so it warms up for that much longer.
+  // a sliding transform starts from silence rather than the rings (catching it up would
+  // be a whole window of pushes at once, see fwht::SlidingTransform), so it warms up
+  // for a whole window too
+  template <typename S>
+  void StartSwitch(Core<S>& c, Settings const& s)
+  {
+    Engine<S>& incoming = c.engines[1 - active_];
+    incoming.settings = s;
+    ResetEngine(incoming);
+
+    int missing = s.sliding ? s.win_size : std::max(s.win_size - history_, 0);
+    switching_  = true;
+    switch_pos_ = 0;
+    warmup_     = (s.overlap > 1 ? s.win_size : s.hop_size) + missing;
+  }
+
+  // clear out everything an engine has built up, for its current settings
+  // this forgets the last frame's selection too, since it no longer applies,
+  // and the sliding transforms start again from silence
+  template <typename S>
+  void ResetEngine(Engine<S>& e)
+  {
+    for (int i = 0; i < kNumInputs; ++i)
+    {
+      Lane<S>& l = e.lanes[i];
+      l.hop_fill    = e.settings.phase[i];
+      l.overlap_pos = 0;
+      l.history.Reset();
+      if (e.settings.sliding)
+        l.sliding.SetPower(e.settings.win_power);
+      memset(l.output_queue, 0, e.settings.win_size * sizeof(S));
+      memset(l.output_buf,   0, e.settings.win_size * sizeof(S));
+    }
+  }
+
   // this is called by both processReplacing and processDoubleReplacing
   template <typename T> 
   void process(T** inputs, T** outputs, VstInt32 sampleFrames);
 
-  // perform the actual work
-  template <typename TIn, typename TOut>
-  void walsh(TIn* input, TOut* output);
+  // fade a block out, while the channels are about to change hands, or back in
+  // once they have (see handover_gain_)
+  template <typename T>
+  void Fade(T** outputs, int sampleFrames, bool out);
+
+  // the audio thread's side when it has the channels: start again if it's been asked to,
+  // and run the engines over the block
+  template <typename T, typename S>
+  void sync_process(Core<S>& c, Settings const& s, T** inputs, T** outputs, int sampleFrames);
+
+  // run the engines over a block, on whichever thread owns the channels
+  // s is the latest settings, which the engines follow (crossfading to a new layout),
+  // and slack is how long after the end of the block the frames can finish by
+  template <typename T, typename S>
+  void run(Core<S>& c, Settings const& s, T** inputs, T** outputs, int sampleFrames, int slack);
+
+  // run the due channels of an engine's frames, on the workers if they're on
+  // (either a channel each, or between them on every channel's transforms)
+  template <typename T, typename S>
+  void run_frames(Core<S>& c, Engine<S>& e, T** inputs, int* written, int const* due, int num_due, int done, bool direct, int64_t deadline);
+
+  // the audio thread's side of the background thread: hand over the input and take
+  // back the finished output. offline, it waits for the output rather than dropping out
+  template <typename T>
+  void async_process(T** inputs, T** outputs, int sampleFrames, bool offline);
+
+  // start the background thread, if we're open and it isn't running already. this is only
+  // ever called from the host's own (non audio) threads, and once it's started it runs until
+  // we're closed, asleep whenever it has nothing to do. it has to be running for parameter
+  // changes to get published, so we always start it, not only when the frames are async
+  void StartBackground();
+
+  // let the background thread know there's something new for it, in case it's asleep.
+  // this never takes a lock, so the audio thread can do it every block (see algos::WakeEvent)
+  void WakeBackground()
+  {
+    async_posted_.fetch_add(1);
+    async_wake_.Wake();
+  }
+
+  // the background thread, and its frames. async_restart returns whether there was room
+  // for the settings, and without it async_step hands back silence
+  void async_work();
+  template <typename S>
+  bool async_restart(Core<S>& c, Settings const& s);
+  template <typename S>
+  bool async_step(Core<S>& c, Settings const& s, bool room);
+
+  // what every channel's frame needs to know, so they can be handed out to the workers
+  // written is per channel, since staggered channels catch their rings up at different times,
+  // and channels says which ones are due a frame
+  template <typename T, typename S>
+  struct FrameJob
+  {
+    WalshingMachine* self;
+    Core<S>*         core;
+    Engine<S>*       engine;
+    T**              inputs;
+    int*             written;
+    int const*       channels;
+    int              done;
+    bool             direct;
+    int64_t          deadline;
+  };
+
+  // run the index'th due channel's frame of a FrameJob, which is what the workers call
+  template <typename T, typename S>
+  static void RunFrame(void* job, int index);
+
+  // transform a window of a channel's input and queue up the next hop of an engine's output
+  // the window is split in two the same way as for walsh()
+  template <typename TIn, typename S>
+  void frame(Core<S>& c, Engine<S>& e, int channel, TIn const* first, int first_size, TIn const* second, int64_t deadline);
+
+  // queue up the next hop of a channel's output from an engine's sliding transform
+  template <typename S>
+  void slide_frame(Core<S>& c, Engine<S>& e, int channel);
+
+  // filter and remove a channel's coefficients, then normalize them
+  template <typename S>
+  void shape(Core<S>& c, Engine<S>& e, int channel);
+
+  // perform the actual work for one channel, leaving the output in its coefficients
+  // the window is first[0..first_size) followed by second[0..win_size - first_size),
+  // which lets us work straight from the end of a ring buffer.
+  // if there's a taper the input is windowed with it on the way in.
+  // if the transforms are split, the workers help with them, by the deadline
+  template <typename TIn, typename S>
+  void walsh(Core<S>& c, Engine<S>& e, int channel, TIn const* first, int first_size, TIn const* second, S const* taper, int64_t deadline);
+
+  // the workers, as the pool a transform is split up over (see fwht::ParallelStages)
+  struct SplitPool
+  {
+    WalshingMachine* self;
+    int64_t          deadline;
+
+    int  Ways() const { return self->workers_->Threads() + 1; }
+    void Run(fwht::Task task, void* context, int count) { self->workers_->Run(self->client_, task, context, count, deadline); }
+  };
+
+  // the transform tables and the analysis/synthesis windows for overlapping, for every
+  // window size. they're built up front, so changing the window size doesn't have to build
+  // (or allocate) anything, and after that they're only ever read (our transforms always
+  // go to the type they're worked out in, so they never touch the plans' scratch space),
+  // so every instance in the process shares one set. the first instance builds them and
+  // the last one frees them.
+  // the offline windows would be 100MB or so of tables between them, so those are only
+  // built the first time an instance makes room for one
+  template <typename S>
+  struct TableSet
+  {
+    explicit TableSet(int max_power) : plans(max_power), windows(max_power) {}
+
+    void Build(int power)
+    {
+      plans.Build(power);
+      windows.Build(power);
+    }
+
+    fwht::PlanSet<S>          plans;
+    algos::SqrtHannWindows<S> windows;
+  };
+
+  // one set for each precision we work the frames out in
+  struct Tables
+  {
+    Tables() : wide(kMaxWinPower), narrow(kMaxWinPower) {}
+
+    TableSet<double> wide;
+    TableSet<float>  narrow;
+  };
+
+  void JoinTables();
+  void LeaveTables();
+
+  // build the tables for windows up to 2^power, for the precision we're using,
+  // if they haven't been already
+  void BuildTables(int power);
+
+  Tables* tables_;
+
+  static Tables* shared_tables_;
+  static int     shared_tables_users_;
 
-  // a special sortable structure
-  // we use it so that we can maintain the original index after sorting
-  struct Coeff
+  // the size of the hand-offs, which have to fit a window of output
+  // (the most we're ever behind by) plus a block of up to kAsyncBlock samples
+  static const int kAsyncPower = kMaxWinPower + 2;
+  static const int kAsyncBlock = 1<<kMaxWinPower;
+
+  // everything a channel works on, so each one can work on its frames by itself
+  // (and at the same time as the others)
+  // the buffers all come from the arena, and are laid out by Place
+  template <typename S>
+  struct Channel
+  {
+    Channel() : coeffs(NULL) {}
+
+    // finds which coefficients to remove
+    algos::MagnitudeSelector<S> selector;
+
+    // the input history for when we work on windows larger than the number of sample frames
+    // we need to keep past information to do things properly
+    // this is a ring, so each block only writes its new samples instead of shifting the whole window
+    // both engines read their windows from it while we're switching between them
+    algos::RingBuffer<S> input_ring;
+
+    // the coefficients of the current frame
+    // the inverse transform goes back in here too
+    S* coeffs;
+  };
+
+  // the hand-offs to and from the background thread, for each channel
+  // the output one starts with a window of silence in it, which is the
+  // time the background thread has to get each hop back to us.
+  // they aren't in the arena: they're only allocated (by the background thread) the
+  // first time it takes over, and they're big enough for any window, so the window
+  // can change while the audio thread is using them
+  struct Handoff
   {
-    int    idx;
-    double val;
+    algos::SpscRing<double> input;
+    algos::SpscRing<double> output;
 
-    Coeff() : idx(0), val(0) {}
-    Coeff(int idx, double val) : idx(idx), val(val) {}
-    inline int operator <(const Coeff& other) { return std::abs(val) < std::abs(other.val); }
+    // where the background thread takes its input out of the hand-off, and puts its output
+    algos::AlignedArray<double> in;
+    algos::AlignedArray<double> out;
   };
 
-  // coefficients that have enough room for our max window size
-  // has a special type so that when it's sorted, it's still obvious
-  // which index it came from originally
-  double coeffs_[1<<kMaxWinPower];
-  Coeff  sort_coeffs_[1<<kMaxWinPower];
+  Handoff handoffs_[kNumInputs];
+
+  // everything about a channel's frames that depends on the window size (and hop, overlap
+  // and stagger), so there can be two sets of them running at once while we switch
+  // these come from the arena too
+  template <typename S>
+  struct Lane
+  {
+    Lane() : output_queue(NULL), output_buf(NULL), hop_fill(0), overlap_pos(0) {}
+
+    // the last selection, which seeds the next one
+    algos::SelectionHistory<S> history;
+
+    // the sliding transform, for tiny hops
+    // it has to see every sample, so it starts from silence whenever the engine does,
+    // and the engine warms up for a whole window before we listen to it (see StartSwitch)
+    fwht::SlidingTransform<S> sliding;
+
+    // the output for the last finished hop, which goes out during the current one
+    S* output_queue;
+
+    // where the overlapping frames are added up, because our normal output is only of size
+    // sampleFrames, but every frame has output for the whole window
+    // it's a ring of a window, overlap_pos is where the oldest (next to finish) sample is
+    S* output_buf;
+
+    // how far we are through this channel's current hop
+    int hop_fill;
+
+    // where the oldest sample of the overlap-add ring is
+    int overlap_pos;
+  };
+
+  // the frames of every channel for one layout, and the settings they're using
+  template <typename S>
+  struct Engine
+  {
+    Settings settings;
+    Lane<S>  lanes[kNumInputs];
+  };
+
+  // the channels and engines, with everything in them worked out in S, and the tables for S.
+  // we have one in doubles and one in floats, and the host picks which with setProcessPrecision
+  // (doubles if it never says). only the one we're using is laid out in the arena,
+  // and the other's buffers are all empty (see Drop).
+  //
+  // in floats the butterflies are twice as wide, and there's half as much memory to go
+  // through. every transform is log2(N) passes of adds, and the walsh-hadamard transform
+  // scaled by 1/sqrt(N) is orthogonal, so rounding doesn't grow from pass to pass: each
+  // pass adds at most about 2^-24 of the signal's energy as noise. forward and back, a
+  // frame's output differs from the double one by at most about (2 log2(N) + 4) * 2^-24
+  // of the window's rms, -114dB at 2^14 and -111dB at 2^22 (measured it's -135dB to
+  // -147dB, since the roundings don't all line up). the sums for the normalization stay
+  // in doubles, so they don't add anything. the one thing that can differ by more is a
+  // coefficient that's within a rounding of the loss threshold (or of its neighbour in
+  // the count and energy modes), which can land on the other side of it, just as it can
+  // from one frame to the next
+  template <typename S>
+  struct Core
+  {
+    Core() : tables(NULL) {}
+
+    TableSet<S>* tables;
+    Channel<S>   channels[kNumInputs];
+    Engine<S>    engines[2];
+  };
+
+  Core<double> wide_;
+  Core<float>  narrow_;
+
+  // which of them we're using, as a VstProcessPrecision
+  // it only changes while we're suspended, and we have the channels
+  std::atomic<int> precision_;
+
+  bool UseFloats() { return precision_.load() == kVstProcessPrecision32; }
+
+  // the engine we're listening to, and while switching_ the other one is warming up
+  // on the new layout. switch_pos_ is how far we are into the switch: the new engine's
+  // output is ready from warmup_ on, and we crossfade to it over the kCrossfade after that
+  int  active_;
+  bool switching_;
+  int  switch_pos_;
+  int  warmup_;
+
+  // how much of the input in the rings is real, rather than the silence they grew from.
+  // starting again from silence counts as real
+  int  history_;
+
+  // lay the channels' and the engines' buffers out in an arena, for windows up to 2^power,
+  // and sliding transforms up to 2^sliding_power, for the precision we're using
+  // the buffers belong to whoever has the channels, and they all start from 0, since
+  // an arena's only ever laid out once, straight after it's reserved (by Allocate or Prepare)
+  void Place(algos::Arena& arena, int power, int sliding_power);
+  template <typename S>
+  void Place(Core<S>& c, algos::Arena& arena, int power, int sliding_power);
+
+  // let go of the other precision's buffers, which were in an arena we've since swapped
+  // out, so only the core we're using has anything laid out
+  template <typename S>
+  void Drop(Core<S>& c);
+
+  // make a new arena for windows up to 2^power (sliding up to 2^sliding_power) and lay
+  // everything out in it. this allocates, so it's only for when nothing's processing, or the
+  // background thread. if there isn't the memory for it, everything stays where it was,
+  // and it returns false
+  bool Allocate(int power, int sliding_power);
+
+  // whether an arena has room for some settings
+  static bool Room(Settings const& s, int power, int sliding_power)
+  { return s.win_power <= power && (!s.sliding || s.win_power <= sliding_power); }
+
+  // whether the buffers are big enough for some settings, on the thread that has the channels.
+  // if they aren't, but the background thread has made us a big enough spare arena,
+  // we grow into it
+  template <typename S>
+  bool Fits(Core<S>& c, Settings const& s);
+
+  // swap over to the spare arena, carrying on with everything we're listening to: the input
+  // the rings have kept, and the active engine's queued output and selection. the background
+  // thread can't copy it for us ahead of time, since it keeps changing until the moment we
+  // swap, so we do it here, which is a copy of a window or so per channel, once per growth.
+  // the old arena stays put as the spare, and the background thread frees it
+  template <typename S>
+  void Grow(Core<S>& c);
+
+  // the background thread's side of that: make the spare when the window (or the sliding
+  // transform) needs more room than we have (offline windows included), and free the old
+  // arena once we're done with it. nothing else does, so it never holds up the audio thread
+  // or the host's calls, and the audio thread only finds out when spare_ready_ is set
+  bool Prepare();
+
+  // get the channels back from the background thread, when nothing's processing,
+  // and once we've started again, hand them to it if the settings say it should have them
+  // (so the first block doesn't have to fade out the silence we've just started from)
+  void TakeChannels();
+  void GiveChannels();
+
+  // everything's laid out in arena_, for windows up to 2^arena_power_ and sliding ones up
+  // to 2^arena_slide_, and those belong to whoever has the channels. spare_ is the bigger one
+  // the background thread makes when the window grows past that: it's the background thread's
+  // until spare_ready_, and then it's the channels'. it always has room for everything the
+  // arena has too, so the engine we're listening to still fits once we've swapped.
+  // capacity_ and slide_capacity_ are the biggest windows either of them has room for,
+  // which is as big as the settings go, and grow_to_ and slide_to_ are the ones we've been
+  // asked for. arena_mutex_ keeps Allocate from making a new arena while a spare's being
+  // made to go with the old one
+  algos::Arena      arena_;
+  int               arena_power_;
+  int               arena_slide_;
+  algos::Arena      spare_;
+  int               spare_power_;
+  int               spare_slide_;
+  std::atomic<bool> spare_ready_;
+  std::atomic<int>  capacity_;
+  std::atomic<int>  slide_capacity_;
+  std::atomic<int>  grow_to_;
+  std::atomic<int>  slide_to_;
+  std::mutex        arena_mutex_;
+
+  // the smallest window we couldn't get the memory for, so we don't keep trying
+  std::atomic<int> too_big_;
+
+  // how big an arena each window size (and sliding window size) needs in each precision,
+  // and how much we've allocated in all
+  size_t              arena_bytes_[kVstProcessPrecision64 + 1][kMaxOfflinePower + 1][kMaxSlidingPower + 1];
+  std::atomic<size_t> footprint_;
+
+  size_t ArenaBytes(int power, int sliding_power) { return arena_bytes_[precision_.load()][power][sliding_power]; }
+
+  // whether the host is rendering offline, as of the audio thread's last block
+  // (or startProcess, if the host's told us there)
+  std::atomic<bool> offline_;
+
+  // which of the kStaggerSlots this instance does its frames in, and how many
+  // instances there have been, which hands them out
+  int                          instance_slot_;
+  static std::atomic<unsigned> instance_count_;
+
+  // the threads that work on the other channels while the host's thread does the first,
+  // and our slot in them (-1 if we didn't get one)
+  // there's a single pool for the whole process, since a session can have dozens of us
+  // and a set of threads each would be far more threads than cores. the first instance
+  // to open creates it and the last one to close destroys it
+  algos::WorkerPool* workers_;
+  int                client_;
+
+  static algos::WorkerPool* shared_workers_;
+  static int                shared_users_;
+  static std::mutex         shared_mutex_;
+
+  // the settings, for the audio thread and the background thread, which each take the latest
+  // at the start of what they're doing. the threads never have to wait for them, and they
+  // never change underneath them
+  algos::Snapshot<Settings> settings_;
+  algos::Snapshot<Settings> async_settings_;
+
+  // the last settings we published, what the latest epoch and layout are, and the lock
+  // for publishing them, since the background thread and the host's own threads both do
+  Settings   published_;
+  unsigned   epoch_;
+  unsigned   layout_;
+  std::mutex publish_mutex_;
+
+  // the latency of the last settings we published, and the last one we told the host about
+  std::atomic<int> latency_;
+  std::atomic<int> reported_latency_;
+
+  // the epoch the audio thread last started again at
+  unsigned sync_epoch_;
+
+  // who owns the channels. the audio thread asks for the background thread to take them
+  // (from scratch) or give them back, and only touches them (or the hand-offs) again once
+  // the background thread has answered with the same value. every request is numbered
+  // (request << 1 | take), so an old answer can't be mistaken for the answer to a new one.
+  // async_owner_ is what the audio thread last asked for: the epoch the background thread
+  // started again at (epoch << 1 | 1), or 0 for the audio thread itself
+  void RequestChannels(bool async)
+  {
+    async_want_.store((++async_requests_ << 1) | (async ? 1 : 0));
+    WakeBackground();
+  }
+
+  unsigned              async_owner_;
+  unsigned              async_requests_;
+  std::atomic<unsigned> async_want_;
+  std::atomic<unsigned> async_have_;
+  std::atomic<bool>     async_stop_;
+
+  // the background thread can only be started between open and close, and
+  // async_running_ is whether it has been. async_mutex_ is what it's started under
+  bool                  async_open_;
+  std::atomic<bool>     async_running_;
+  std::thread           async_thread_;
+
+  // how many times the background thread has been told there's something new,
+  // and what it goes to sleep on when it's run out of things to do
+  std::atomic<uint64_t> async_posted_;
+  algos::WakeEvent      async_wake_;
+  std::mutex            async_mutex_;
 
-  // an input buffer for when we work on windows larger than the number of sample frames
-  // we need to keep past information to do things properly
-  double input_buf_ [kNumInputs][1<<kMaxWinPower];
+  // which hand-over the audio thread's side is up to, and how many samples of
+  // silence it's made up because the background thread was late, which it skips
+  // once they turn up so we don't end up any later than we said we would be
+  unsigned async_seen_;
+  int      async_debt_;
 
-  // an output buffer, because our normal output is only of size sampleFrames, but we
-  // need to calculate output for the whole window and then copy only the "good" data
-  // into the output
-  double output_buf_[kNumInputs][1<<kMaxWinPower];
+  // how loud the audio thread lets the output through, out of kCrossfade, while the channels
+  // change hands. whoever has them carries on while we fade out, they're only handed over
+  // once we're silent, and we fade back in once the new owner's output has got through
+  // the handover_hold_ samples of its latency (which starts again from silence)
+  int handover_gain_;
+  int handover_hold_;
 };
\ No newline at end of file